@@ -284,6 +284,37 @@ static std::pair<int, int> split_middle(
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
+// Maximum depth of bvh nodes split in the middle. Deeper nodes are split at
+// the median, so that degenerate meshes only add the logarithm of their size
+// to the depth, which stays within the traversal stacks.
+const int bvh_max_depth = 64;
+
+// Maximum number of entries in the bvh traversal stacks.
+const int bvh_max_stack = 128;
+
+// Splits a BVH node at the median of the primitive centers along the largest
+// axis. Returns split position and axis.
+static std::pair<int, int> split_median(
+    std::vector<bvh_primitive>& primitives, int start, int end) {
+  // compute primintive bounds and size
+  auto cbbox = invalidb3f;
+  for (auto i = start; i < end; i++) cbbox = merge(cbbox, primitives[i].center);
+  auto csize = cbbox.max - cbbox.min;
+
+  // split along largest
+  auto axis = 0;
+  if (csize.y > csize[axis]) axis = 1;
+  if (csize.z > csize[axis]) axis = 2;
+
+  // partition around the median
+  auto mid = (start + end) / 2;
+  std::nth_element(primitives.begin() + start, primitives.begin() + mid,
+      primitives.begin() + end, [axis](auto& a, auto& b) {
+        return a.center[axis] < b.center[axis];
+      });
+  return {mid, axis};
+}
+
 // Build BVH nodes
 static void build_bvh(
     std::vector<bvh_node>& nodes, std::vector<bvh_primitive>& primitives) {
@@ -291,8 +322,8 @@ static void build_bvh(
   nodes.clear();
   nodes.reserve(primitives.size() * 2);
 
-  // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
+  // queue up first node, with its primitive range and depth
+  auto queue = std::deque<vec4i>{{0, 0, (int)primitives.size(), 0}};
   nodes.emplace_back();
 
   // create nodes until the queue is empty
@@ -300,7 +331,7 @@ static void build_bvh(
     // grab node to work on
     auto next = queue.front();
     queue.pop_front();
-    auto nodeid = next.x, start = next.y, end = next.z;
+    auto nodeid = next.x, start = next.y, end = next.z, depth = next.w;
 
     // grab node
     auto& node = nodes[nodeid];
@@ -313,7 +344,9 @@ static void build_bvh(
     // split into two children
     if (end - start > bvh_max_prims) {
       // get split
-      auto [mid, axis] = split_middle(primitives, start, end);
+      auto [mid, axis] = depth < bvh_max_depth
+                             ? split_middle(primitives, start, end)
+                             : split_median(primitives, start, end);
 
       // make an internal node
       node.internal = true;
@@ -322,8 +355,8 @@ static void build_bvh(
       node.start    = (int)nodes.size();
       nodes.emplace_back();
       nodes.emplace_back();
-      queue.push_back({node.start + 0, start, mid});
-      queue.push_back({node.start + 1, mid, end});
+      queue.push_back({node.start + 0, start, mid, depth + 1});
+      queue.push_back({node.start + 1, mid, end, depth + 1});
     } else {
       // Make a leaf node
       node.internal = false;
@@ -379,20 +412,8 @@ static void init_bvh(rtr::shape* shape, const trace_params& params) {
   }
 }
 
-void init_bvh(rtr::scene* scene, const trace_params& params,
-    progress_callback progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
-
-  // shapes
-  for (auto idx = 0; idx < scene->shapes.size(); idx++) {
-    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
-    init_bvh(scene->shapes[idx], params);
-  }
-
-  // handle progress
-  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
-
+// Build the scene bvh over the object bounds.
+static void init_scene_bvh(rtr::scene* scene, const trace_params& params) {
   // instance bboxes
   auto primitives = std::vector<bvh_primitive>{};
   auto object_id  = 0;
@@ -416,14 +437,241 @@ void init_bvh(rtr::scene* scene, const trace_params& params,
   for (auto& primitive : primitives) {
     scene->bvh->primitives.push_back(primitive.primitive);
   }
+}
+
+void init_bvh(rtr::scene* scene, const trace_params& params,
+    progress_callback progress_cb) {
+  // handle progress
+  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
+
+  // shapes
+  for (auto idx = 0; idx < scene->shapes.size(); idx++) {
+    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
+    init_bvh(scene->shapes[idx], params);
+  }
+
+  // handle progress
+  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
+
+  // scene
+  init_scene_bvh(scene, params);
 
   // handle progress
   if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
 }
 
+// Refit bvh nodes bottom-up from the bounds of the bvh primitives. Children
+// are always stored after their parents, so nodes are updated in reverse.
+static void update_bvh(bvh_tree* bvh, const std::vector<bbox3f>& bboxes) {
+  for (auto nodeid = (int)bvh->nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh->nodes[nodeid];
+    node.bbox  = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, bvh->nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        node.bbox = merge(node.bbox, bboxes[node.start + idx]);
+      }
+    }
+  }
+}
+
+static void update_bvh(rtr::shape* shape, const trace_params& params) {
+  // build primitives
+  auto bvh    = shape->bvh;
+  auto bboxes = std::vector<bbox3f>(bvh->primitives.size());
+  if (!shape->points.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& p     = shape->points[bvh->primitives[idx]];
+      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& l     = shape->lines[bvh->primitives[idx]];
+      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
+          shape->radius[l.x], shape->radius[l.y]);
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& t     = shape->triangles[bvh->primitives[idx]];
+      bboxes[idx] = triangle_bounds(
+          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+    }
+  }
+
+  // update nodes
+  update_bvh(bvh, bboxes);
+}
+
+void update_bvh(rtr::scene* scene,
+    const std::vector<rtr::shape*>& updated_shapes,
+    const trace_params&             params) {
+  // refit shapes
+  for (auto shape : updated_shapes) update_bvh(shape, params);
+
+  // rebuild the scene bvh, which is small and may change a lot
+  init_scene_bvh(scene, params);
+}
+
+// Intersect a ray with a bounding box as intersect_bbox(), also returning
+// the distance at which the ray enters the box.
+static bool intersect_bbox(const ray3f& ray, const vec3f& ray_dinv,
+    const bbox3f& bbox, float& tnear) {
+  auto it_min = (bbox.min - ray.o) * ray_dinv;
+  auto it_max = (bbox.max - ray.o) * ray_dinv;
+  auto tmin   = min(it_min, it_max);
+  auto tmax   = max(it_min, it_max);
+  auto t0     = max(max(tmin), ray.tmin);
+  auto t1     = min(min(tmax), ray.tmax);
+  t1 *= 1.00000024f;  // for double: 1.0000000000000004
+  tnear = t0;
+  return t0 <= t1;
+}
+
+// Intersect ray with a bvh, calling `intersect_leaf(start, num, ray)` for the
+// leaves, that returns whether a primitive is hit and updates the ray tmax.
+// Both children are tested at their parent. The traversal descends into the
+// nearer child and pushes the farther one only when both are hit, so the
+// stack holds at most one node per tree level.
+template <typename Func>
+static bool intersect_bvh(const bvh_tree* bvh, const ray3f& ray_,
+    bool find_any, Func&& intersect_leaf) {
+  // check empty
+  if (bvh->nodes.empty()) return false;
+
+  // node stack, with the entry distances of the nodes
+  int   node_stack[bvh_max_stack];
+  float dist_stack[bvh_max_stack];
+  auto  node_cur = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // start from the root if hit
+  auto tnear = 0.0f;
+  if (!intersect_bbox(ray, ray_dinv, bvh->nodes[0].bbox, tnear)) return false;
+  auto nodeid = 0;
+
+  // walking stack
+  while (nodeid >= 0) {
+    // visit internal nodes or intersect leaves
+    auto& node = bvh->nodes[nodeid];
+    nodeid     = -1;
+    if (node.internal) {
+      float tleft, tright;
+      auto  hit_left = intersect_bbox(
+          ray, ray_dinv, bvh->nodes[node.start + 0].bbox, tleft);
+      auto hit_right = intersect_bbox(
+          ray, ray_dinv, bvh->nodes[node.start + 1].bbox, tright);
+      if (hit_left && hit_right) {
+        auto near            = tleft <= tright ? 0 : 1;
+        node_stack[node_cur] = node.start + 1 - near;
+        dist_stack[node_cur] = max(tleft, tright);
+        node_cur++;
+        nodeid = node.start + near;
+      } else if (hit_left || hit_right) {
+        nodeid = node.start + (hit_left ? 0 : 1);
+      }
+    } else if (intersect_leaf(node.start, node.num, ray)) {
+      hit = true;
+      if (find_any) return hit;
+    }
+
+    // grab the next node, skipping the ones farther than the closest hit
+    while (nodeid < 0 && node_cur) {
+      node_cur--;
+      if (dist_stack[node_cur] <= ray.tmax) nodeid = node_stack[node_cur];
+    }
+  }
+
+  return hit;
+}
+
 // Intersect ray with a bvh->
-static bool intersect_shape_bvh(rtr::shape* shape, const ray3f& ray_,
+static bool intersect_shape_bvh(rtr::shape* shape, const ray3f& ray,
     int& element, vec2f& uv, float& distance, bool find_any) {
+  return intersect_bvh(
+      shape->bvh, ray, find_any, [&](int start, int num, ray3f& ray) {
+        auto hit = false;
+        if (!shape->points.empty()) {
+          for (auto idx = start; idx < start + num; idx++) {
+            auto& p = shape->points[shape->bvh->primitives[idx]];
+            if (intersect_point(
+                    ray, shape->positions[p], shape->radius[p], uv, distance)) {
+              hit      = true;
+              element  = shape->bvh->primitives[idx];
+              ray.tmax = distance;
+            }
+          }
+        } else if (!shape->lines.empty()) {
+          for (auto idx = start; idx < start + num; idx++) {
+            auto& l = shape->lines[shape->bvh->primitives[idx]];
+            if (intersect_line(ray, shape->positions[l.x],
+                    shape->positions[l.y], shape->radius[l.x],
+                    shape->radius[l.y], uv, distance)) {
+              hit      = true;
+              element  = shape->bvh->primitives[idx];
+              ray.tmax = distance;
+            }
+          }
+        } else if (!shape->triangles.empty()) {
+          for (auto idx = start; idx < start + num; idx++) {
+            auto& t = shape->triangles[shape->bvh->primitives[idx]];
+            if (intersect_triangle(ray, shape->positions[t.x],
+                    shape->positions[t.y], shape->positions[t.z], uv,
+                    distance)) {
+              hit      = true;
+              element  = shape->bvh->primitives[idx];
+              ray.tmax = distance;
+            }
+          }
+        }
+        return hit;
+      });
+}
+
+// Intersect ray with a bvh->
+static bool intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray,
+    int& object, int& element, vec2f& uv, float& distance, bool find_any,
+    bool non_rigid_frames) {
+  return intersect_bvh(
+      scene->bvh, ray, find_any, [&](int start, int num, ray3f& ray) {
+        auto hit = false;
+        for (auto idx = start; idx < start + num; idx++) {
+          auto object_ = scene->objects[scene->bvh->primitives[idx]];
+          auto inv_ray = transform_ray(
+              inverse(object_->frame, non_rigid_frames), ray);
+          if (intersect_shape_bvh(
+                  object_->shape, inv_ray, element, uv, distance, find_any)) {
+            hit      = true;
+            object   = scene->bvh->primitives[idx];
+            ray.tmax = distance;
+          }
+        }
+        return hit;
+      });
+}
+
+// Intersect ray with a bvh->
+static bool intersect_instance_bvh(const rtr::object* object, const ray3f& ray,
+    int& element, vec2f& uv, float& distance, bool find_any,
+    bool non_rigid_frames) {
+  auto inv_ray = transform_ray(inverse(object->frame, non_rigid_frames), ray);
+  return intersect_shape_bvh(
+      object->shape, inv_ray, element, uv, distance, find_any);
+}
+
+// Check whether a ray hits any primitive of a shape bvh. The larger child
+// is visited first, since it is the most likely to contain an occluder.
+static bool occluded_shape_bvh(rtr::shape* shape, const ray3f& ray) {
   // get bvh and shape pointers for fast access
   auto bvh = shape->bvh;
 
@@ -431,20 +679,20 @@ static bool intersect_shape_bvh(rtr::shape* shape, const ray3f& ray_,
   if (bvh->nodes.empty()) return false;
 
   // node stack
-  int  node_stack[128];
+  int  node_stack[bvh_max_stack];
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // shared variables
-  auto hit = false;
-
-  // copy ray to modify it
-  auto ray = ray_;
+  // shared variables, unused since we only check for hits
+  auto uv       = zero2f;
+  auto distance = 0.0f;
 
   // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto area     = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
 
   // walking stack
   while (node_cur) {
@@ -452,64 +700,45 @@ static bool intersect_shape_bvh(rtr::shape* shape, const ray3f& ray_,
     auto& node = bvh->nodes[node_stack[--node_cur]];
 
     // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
     if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
+    // visit internal nodes, or stop at the first occluder
     if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
+      auto left = node.start + 0, right = node.start + 1;
+      if (area(bvh->nodes[left].bbox) > area(bvh->nodes[right].bbox))
+        std::swap(left, right);
+      node_stack[node_cur++] = left;
+      node_stack[node_cur++] = right;
     } else if (!shape->points.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape->points[shape->bvh->primitives[idx]];
+        auto& p = shape->points[bvh->primitives[idx]];
         if (intersect_point(
-                ray, shape->positions[p], shape->radius[p], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
+                ray, shape->positions[p], shape->radius[p], uv, distance))
+          return true;
       }
     } else if (!shape->lines.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape->lines[shape->bvh->primitives[idx]];
+        auto& l = shape->lines[bvh->primitives[idx]];
         if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
-                shape->radius[l.x], shape->radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
+                shape->radius[l.x], shape->radius[l.y], uv, distance))
+          return true;
       }
     } else if (!shape->triangles.empty()) {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape->triangles[shape->bvh->primitives[idx]];
+        auto& t = shape->triangles[bvh->primitives[idx]];
         if (intersect_triangle(ray, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
+                shape->positions[t.y], shape->positions[t.z], uv, distance))
+          return true;
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
-  return hit;
+  return false;
 }
 
-// Intersect ray with a bvh->
-static bool intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray_,
-    int& object, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
+// Check whether a ray hits any object of the scene bvh.
+static bool occluded_scene_bvh(
+    const rtr::scene* scene, const ray3f& ray, bool non_rigid_frames) {
   // get bvh and scene pointers for fast access
   auto bvh = scene->bvh;
 
@@ -517,20 +746,16 @@ static bool intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray_,
   if (bvh->nodes.empty()) return false;
 
   // node stack
-  int  node_stack[128];
+  int  node_stack[bvh_max_stack];
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // shared variables
-  auto hit = false;
-
-  // copy ray to modify it
-  auto ray = ray_;
-
   // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto area     = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
 
   // walking stack
   while (node_cur) {
@@ -538,49 +763,26 @@ static bool intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray_,
     auto& node = bvh->nodes[node_stack[--node_cur]];
 
     // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
     if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
+    // visit internal nodes, or stop at the first occluder
     if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
+      auto left = node.start + 0, right = node.start + 1;
+      if (area(bvh->nodes[left].bbox) > area(bvh->nodes[right].bbox))
+        std::swap(left, right);
+      node_stack[node_cur++] = left;
+      node_stack[node_cur++] = right;
     } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto object_ = scene->objects[scene->bvh->primitives[idx]];
+        auto object  = scene->objects[bvh->primitives[idx]];
         auto inv_ray = transform_ray(
-            inverse(object_->frame, non_rigid_frames), ray);
-        if (intersect_shape_bvh(
-                object_->shape, inv_ray, element, uv, distance, find_any)) {
-          hit      = true;
-          object   = scene->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
+            inverse(object->frame, non_rigid_frames), ray);
+        if (occluded_shape_bvh(object->shape, inv_ray)) return true;
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
-  return hit;
-}
-
-// Intersect ray with a bvh->
-static bool intersect_instance_bvh(const rtr::object* object, const ray3f& ray,
-    int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto inv_ray = transform_ray(inverse(object->frame, non_rigid_frames), ray);
-  return intersect_shape_bvh(
-      object->shape, inv_ray, element, uv, distance, find_any);
+  return false;
 }
 
 intersection3f intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray,
@@ -599,6 +801,12 @@ intersection3f intersect_instance_bvh(const rtr::object* object,
   return intersection;
 }
 
+bool occluded(const rtr::scene* scene, const ray3f& ray, float tmax,
+    bool non_rigid_frames) {
+  return occluded_scene_bvh(
+      scene, {ray.o, ray.d, ray.tmin, tmax}, non_rigid_frames);
+}
+
 }  // namespace yocto::raytrace
 
 // -----------------------------------------------------------------------------
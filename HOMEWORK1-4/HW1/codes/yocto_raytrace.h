@@ -212,6 +212,13 @@ using progress_callback =
 void init_bvh(rtr::scene* scene, const trace_params& params,
     progress_callback progress_cb = {});
 
+// Update the bvh after moving objects or changing the vertices of shapes.
+// Updated shape bvhs are refit, keeping their topology, while the scene bvh
+// is rebuilt. Shapes must keep their primitives.
+void update_bvh(rtr::scene* scene,
+    const std::vector<rtr::shape*>& updated_shapes,
+    const trace_params&             params);
+
 // Initialize the rendering state
 struct state;
 void init_state(rtr::state* state, const rtr::scene* scene,
@@ -414,6 +421,12 @@ intersection3f intersect_scene_bvh(const rtr::scene* scene, const ray3f& ray,
 intersection3f intersect_instance_bvh(const rtr::object* object,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Check whether a ray is occluded before the distance `tmax`. This is faster
+// than intersect_scene_bvh() with `find_any`, since it only reports whether
+// any occluder is found, and is meant for shadow rays.
+bool occluded(const rtr::scene* scene, const ray3f& ray, float tmax,
+    bool non_rigid_frames = true);
+
 }  // namespace yocto::raytrace
 
 #endif
@@ -57,6 +57,8 @@ struct app_state {
   ptr::scene*              scene        = new ptr::scene{};
   ptr::camera*             camera       = nullptr;
   std::vector<std::string> camera_names = {};
+  std::vector<std::string> object_names = {};
+  int                      selected     = 0;
 
   // rendering state
   img::image<vec4f> render   = {};
@@ -244,10 +246,28 @@ void init_camera_names(std::vector<std::string>& names,
   }
 }
 
-void reset_display(app_state* app) {
+void init_object_names(std::vector<std::string>& names,
+    const std::vector<sio::object*>&             ioobjects) {
+  for (auto ioobject : ioobjects) {
+    if (ioobject->instance) {
+      for (auto idx = 0; idx < ioobject->instance->frames.size(); idx++) {
+        names.push_back(ioobject->name + "[" + std::to_string(idx) + "]");
+      }
+    } else {
+      names.push_back(ioobject->name);
+    }
+  }
+}
+
+void stop_display(app_state* app) {
   // stop render
   app->render_stop = true;
   if (app->render_worker.valid()) app->render_worker.get();
+}
+
+void reset_display(app_state* app) {
+  // stop render
+  stop_display(app);
 
   // init state
   init_state(app->render_state, app->scene, app->camera, app->params);
@@ -334,6 +354,9 @@ int main(int argc, const char* argv[]) {
   // camera names
   init_camera_names(app->camera_names, ioscene->cameras);
 
+  // object names
+  init_object_names(app->object_names, ioscene->objects);
+
   // cleanup
   ioscene_guard.reset();
 
@@ -379,6 +402,18 @@ int main(int argc, const char* argv[]) {
     edited += draw_slider(win, "nbounces", tparams.bounces, 1, 128);
     edited += draw_slider(win, "pratio", tparams.pratio, 1, 64);
     edited += draw_slider(win, "exposure", app->exposure, -5, 5);
+    if (!app->scene->objects.empty()) {
+      draw_combobox(win, "object", app->selected, app->object_names);
+      auto object = app->scene->objects[app->selected];
+      auto frame  = object->frame;
+      if (draw_dragger(win, "position", frame.o, 0.01f)) {
+        // moving objects only requires to rebuild the scene bvh
+        stop_display(app);
+        set_frame(object, frame);
+        update_bvh(app->scene, {}, app->params);
+        edited += 1;
+      }
+    }
     if (edited) reset_display(app);
   };
   callbacks.uiupdate_cb = [app](gui::window* win, const gui::input& input) {
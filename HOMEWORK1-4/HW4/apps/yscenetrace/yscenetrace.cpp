@@ -38,8 +38,13 @@ namespace cli = yocto::commonio;
 namespace sio = yocto::sceneio;
 namespace shp = yocto::shape;
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 using namespace std::string_literals;
 
 #include "ext/filesystem.hpp"
@@ -188,10 +193,92 @@ void init_scene(ptr::scene* scene, sio::model* ioscene, ptr::camera*& camera,
   camera = camera_map.at(iocamera);
 }
 
+// Render up to `params.samples` samples per pixel within `budget` seconds.
+// Throughput is estimated from the first sample, and each round schedules
+// half of the samples that fit in the remaining time, refining the estimate
+// as rendering proceeds. Rendering ends when the next sample would not fit.
+// A timer stops the tiles in flight if the deadline is reached anyway.
+void trace_budget(ptr::state* state, const ptr::scene* scene,
+    const ptr::camera* camera, const ptr::trace_params& params,
+    float budget) {
+  using clock   = std::chrono::steady_clock;
+  auto start    = clock::now();
+  auto deadline = start + std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<float>(budget));
+
+  // stop the rendering at the deadline
+  auto stop     = std::atomic<bool>{false};
+  auto finished = false;
+  auto mutex    = std::mutex{};
+  auto cond     = std::condition_variable{};
+  auto timer    = std::thread([&]() {
+    auto lock = std::unique_lock{mutex};
+    cond.wait_until(lock, deadline, [&]() { return finished; });
+    stop = true;
+  });
+
+  // render in rounds
+  auto samples = 0;
+  cli::print_progress("render image", samples, params.samples);
+  while (samples < params.samples && !stop) {
+    auto elapsed = std::chrono::duration<float>(clock::now() - start).count();
+    auto batch   = 1;
+    if (samples > 0) {
+      auto per_sample = elapsed / samples;
+      auto remaining  = budget - elapsed;
+      if (remaining < per_sample) break;
+      batch = clamp((int)(remaining / per_sample / 2), 1,
+          params.samples - samples);
+    }
+    trace_tiles(state, scene, camera, params, batch, {}, &stop);
+    if (!stop) samples += batch;
+    cli::print_progress("render image", samples, params.samples);
+  }
+  // end the progress line at the samples reached before the deadline
+  if (samples < params.samples) printf("\n");
+
+  // stop the timer
+  {
+    auto lock = std::lock_guard{mutex};
+    finished  = true;
+  }
+  cond.notify_all();
+  timer.join();
+}
+
+// Save the rendering statistics next to the image, since pixels may have
+// different sample counts with adaptive sampling or a time budget.
+bool save_render_info(const std::string& filename, const ptr::state* state,
+    const ptr::trace_params& params, float time, float budget,
+    std::string& error) {
+  auto total       = (size_t)0;
+  auto min_samples = params.samples, max_samples = 0;
+  for (auto& pixel : state->pixels) {
+    total += pixel.samples;
+    min_samples = min(min_samples, pixel.samples);
+    max_samples = max(max_samples, pixel.samples);
+  }
+  auto spp = (float)total / state->pixels.count();
+  cli::print_info("samples per pixel: " + std::to_string(spp));
+  auto info = "{\n"s;
+  info += "  \"samples\": " + std::to_string(params.samples) + ",\n";
+  info += "  \"spp\": " + std::to_string(spp) + ",\n";
+  info += "  \"spp_min\": " + std::to_string(min_samples) + ",\n";
+  info += "  \"spp_max\": " + std::to_string(max_samples) + ",\n";
+  info += "  \"adaptive\": " + std::to_string(params.adaptive) + ",\n";
+  info += "  \"time\": " + std::to_string(time) + ",\n";
+  info += "  \"time_budget\": " + std::to_string(budget) + "\n";
+  info += "}\n";
+  return cli::save_text(filename, info, error);
+}
+
 int main(int argc, const char* argv[]) {
   // options
   auto params      = ptr::trace_params{};
   auto save_batch  = false;
+  auto bvh_stats   = false;
+  auto ray_stats   = false;
+  auto time_budget = 0.0f;
   auto camera_name = ""s;
   auto imfilename  = "out.hdr"s;
   auto filename    = "scene.json"s;
@@ -205,6 +292,31 @@ int main(int argc, const char* argv[]) {
       cli, "--shader,-t", params.shader, "Shader type.", ptr::shader_names);
   add_option(cli, "--bounces,-b", params.bounces, "Maximum number of bounces.");
   add_option(cli, "--clamp", params.clamp, "Final pixel clamping.");
+  add_option(cli, "--bvh", params.bvh, "Bvh type.", ptr::bvh_names);
+  add_option(cli, "--bvh-layout", params.layout, "Bvh layout.",
+      ptr::bvh_layout_names);
+  add_option(cli, "--bvh-triangles/--no-bvh-triangles", params.triangles,
+      "Precompute triangles in bvh leaves.");
+  add_option(cli, "--bvh-cache", params.bvh_cache, "Bvh cache directory.");
+  add_option(cli, "--bvh-reorder/--no-bvh-reorder", params.reorder,
+      "Reorder bvh nodes depth-first.");
+  add_option(cli, "--bvh-stats", bvh_stats, "Print bvh statistics.");
+  add_option(cli, "--threads", params.threads, "Threads, 0 for all cores.");
+  add_option(cli, "--affinity/--no-affinity", params.affinity,
+      "Pin threads to cores.");
+  add_option(cli, "--tile-size", params.tile_size, "Render tile size.");
+  add_option(cli, "--adaptive", params.adaptive,
+      "Adaptive sampling error threshold, 0 to disable.");
+  add_option(cli, "--batch", params.batch, "Samples per adaptive pass.");
+  add_option(cli, "--light-bvh/--no-light-bvh", params.light_bvh,
+      "Sample lights with the light bvh.");
+  add_option(cli, "--exact-pdf/--no-exact-pdf", params.exact_pdf,
+      "Trace lights to evaluate light pdfs.");
+  add_option(cli, "--ray-sort/--no-ray-sort", params.ray_sort,
+      "Sort wavefront rays before traversal.");
+  add_option(cli, "--ray-stats", ray_stats, "Print wavefront ray statistics.");
+  add_option(cli, "--time-budget", time_budget,
+      "Render time limit in seconds, 0 for none.");
   add_option(cli, "--save-batch", save_batch, "Save images progressively");
   add_option(cli, "--output-image,-o", imfilename, "Image filename");
   add_option(cli, "scene", filename, "Scene filename", true);
@@ -233,7 +345,38 @@ int main(int argc, const char* argv[]) {
   init_subdivs(scene, params, cli::print_progress);
 
   // build bvh
+  if (!params.bvh_cache.empty()) fs::create_directories(params.bvh_cache);
+  auto bvh_start = cli::get_time_();
   init_bvh(scene, params, cli::print_progress);
+  auto bvh_time = cli::get_time_() - bvh_start;
+
+  // print bvh stats
+  if (bvh_stats) {
+    auto stats  = get_bvh_stats(scene);
+    auto misses = get_bvh_cache_misses(scene, camera, params);
+    auto format = [](const std::string& value) {
+      auto str = value;
+      while (str.size() < 13) str = " " + str;
+      return str;
+    };
+    cli::print_info("bvh stats --------------");
+    cli::print_info("type:         " + format(ptr::bvh_names[(int)params.bvh]));
+    cli::print_info(
+        "layout:       " + format(ptr::bvh_layout_names[(int)params.layout]));
+    cli::print_info("build time:   " + format(cli::format_duration(bvh_time)));
+    cli::print_info("nodes:        " + format(std::to_string(stats.nodes)));
+    cli::print_info("leaves:       " + format(std::to_string(stats.leaves)));
+    cli::print_info("primitives:   " + format(std::to_string(stats.primitives)));
+    cli::print_info("max depth:    " + format(std::to_string(stats.max_depth)));
+    cli::print_info("max leaf:     " + format(std::to_string(stats.max_prims)));
+    cli::print_info("scene cost:   " + format(std::to_string(stats.scene_cost)));
+    cli::print_info("shapes cost:  " + format(std::to_string(stats.shape_cost)));
+    cli::print_info(
+        "memory:       " + format(std::to_string(stats.memory / 1024) + "kb"));
+    cli::print_info("node memory:  " +
+                    format(std::to_string(stats.node_memory / 1024) + "kb"));
+    cli::print_info("cache misses: " + format(std::to_string(misses) + "/ray"));
+  }
 
   // build lights
   init_lights(scene, params, cli::print_progress);
@@ -243,28 +386,66 @@ int main(int argc, const char* argv[]) {
   auto state = state_guard.get();
   init_state(state, scene, camera, params);
 
-  // render
-  cli::print_progress("render image", 0, params.samples);
-  for(auto sample = 0; sample < params.samples; sample ++) {
-    cli::print_progress("render image", sample, params.samples);
-    trace_samples(state, scene, camera, params);
-    if(save_batch) {
-        auto ext = "-s" + std::to_string(sample) +
-                   fs::path(imfilename).extension().string();
-        auto outfilename = fs::path(imfilename).replace_extension(ext).string();
-        auto ioerror     = ""s;
-        cli::print_progress("save image", sample, params.samples);
-        if (!save_image(outfilename, state->render, ioerror))
-          cli::print_fatal(ioerror);
+  // render all samples tile by tile, unless saving each sample
+  auto render_start = cli::get_time_();
+  if (time_budget > 0) {
+    trace_budget(state, scene, camera, params, time_budget);
+  } else if (!save_batch) {
+    trace_tiles(state, scene, camera, params, params.samples,
+        cli::print_progress);
+  } else {
+    cli::print_progress("render image", 0, params.samples);
+    for(auto sample = 0; sample < params.samples; sample ++) {
+      cli::print_progress("render image", sample, params.samples);
+      trace_samples(state, scene, camera, params);
+      auto ext = "-s" + std::to_string(sample) +
+                 fs::path(imfilename).extension().string();
+      auto outfilename = fs::path(imfilename).replace_extension(ext).string();
+      auto ioerror     = ""s;
+      cli::print_progress("save image", sample, params.samples);
+      if (!save_image(outfilename, state->render, ioerror))
+        cli::print_fatal(ioerror);
+    }
+    cli::print_progress("render image", params.samples, params.samples);
+  }
+
+  auto render_time = (cli::get_time_() - render_start) / 1e9f;
+
+  // print ray throughput per bounce
+  if (ray_stats) {
+    auto format = [](const std::string& value) {
+      auto str = value;
+      while (str.size() < 13) str = " " + str;
+      return str;
+    };
+    cli::print_info("ray stats --------------");
+    cli::print_info("ray sort:     " + format(params.ray_sort ? "on" : "off"));
+    cli::print_info("exact pdf:    " + format(params.exact_pdf ? "on" : "off"));
+    cli::print_info(
+        "light pdf:    " + format(std::to_string(ptr::get_light_pdf_rays())) +
+        " rays");
+    auto stats = get_bounce_stats(state);
+    for (auto bounce = 0; bounce < stats.size(); bounce++) {
+      auto& bstats = stats[bounce];
+      auto  mrays  = bstats.rays / std::max(bstats.seconds, 1e-9) / 1e6;
+      cli::print_info("bounce " + std::to_string(bounce) + ":     " +
+                      format(std::to_string(bstats.rays)) + " rays " +
+                      format(std::to_string(mrays)) + " Mrays/s");
     }
   }
-  cli::print_progress("render image", params.samples, params.samples);
 
   // save image
   cli::print_progress("save image", 0, 1);
   if (!save_image(imfilename, state->render, ioerror)) cli::print_fatal(ioerror);
   cli::print_progress("save image", 1, 1);
 
+  // save the achieved samples, which vary across pixels
+  if (time_budget > 0 || params.adaptive > 0) {
+    if (!save_render_info(imfilename + ".json", state, params, render_time,
+            time_budget, ioerror))
+      cli::print_fatal(ioerror);
+  }
+
   // done
   return 0;
 }
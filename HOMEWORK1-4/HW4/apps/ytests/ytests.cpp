@@ -0,0 +1,80 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2020 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_commonio.h>
+#include <yocto/yocto_math.h>
+#include <yocto_pathtrace/yocto_pathtrace.h>
+using namespace yocto::math;
+namespace ptr = yocto::pathtrace;
+namespace cli = yocto::commonio;
+
+#include <cmath>
+using namespace std::string_literals;
+
+// Check that sampling a large alias table matches its probabilities. Counts
+// are compared with a chi-squared statistic, whose mean is the number of
+// entries and whose deviation is the square root of twice that number.
+bool test_alias_table() {
+  auto nentries = 1 << 20, nsamples = 1 << 24;
+  auto rng      = make_rng(7);
+  auto weights  = std::vector<float>(nentries);
+  auto total    = 0.0;
+  for (auto& weight : weights) {
+    weight = pow(rand1f(rng), 4.0f) + 0.01f;
+    total += weight;
+  }
+  auto alias  = ptr::make_alias_table(weights);
+  auto counts = std::vector<int>(nentries, 0);
+  for (auto sample = 0; sample < nsamples; sample++)
+    counts[ptr::sample_alias(alias, rand1f(rng), rand1f(rng))] += 1;
+  auto chi2 = 0.0;
+  for (auto idx = 0; idx < nentries; idx++) {
+    auto expected = nsamples * weights[idx] / total;
+    chi2 += (counts[idx] - expected) * (counts[idx] - expected) / expected;
+  }
+  auto deviation = (chi2 - nentries) / std::sqrt(2.0 * nentries);
+  cli::print_info("alias table: chi2 " + std::to_string(chi2) + " for " +
+                  std::to_string(nentries) + " entries, " +
+                  std::to_string(deviation) + " deviations");
+  return std::abs(deviation) < 5;
+}
+
+int main(int argc, const char* argv[]) {
+  // parse command line
+  auto cli = cli::make_cli("ytests", "Tests of sampling routines");
+  parse_cli(cli, argc, argv);
+
+  // run tests
+  auto ok = true;
+  ok      = test_alias_table() && ok;
+  if (!ok) cli::print_fatal("tests failed");
+  cli::print_info("tests passed");
+
+  // done
+  return 0;
+}
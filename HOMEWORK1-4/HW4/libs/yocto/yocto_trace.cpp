@@ -846,6 +846,24 @@ static bool intersect_scene_embree_bvh(const trc::scene* scene,
   distance = embree_ray.ray.tfar;
   return true;
 }
+
+static bool occluded_embree_bvh(RTCScene embree_bvh, const ray3f& ray) {
+  RTCRay embree_ray;
+  embree_ray.org_x = ray.o.x;
+  embree_ray.org_y = ray.o.y;
+  embree_ray.org_z = ray.o.z;
+  embree_ray.dir_x = ray.d.x;
+  embree_ray.dir_y = ray.d.y;
+  embree_ray.dir_z = ray.d.z;
+  embree_ray.tnear = ray.tmin;
+  embree_ray.tfar  = ray.tmax;
+  embree_ray.flags = 0;
+  RTCIntersectContext embree_ctx;
+  rtcInitIntersectContext(&embree_ctx);
+  rtcOccluded1(embree_bvh, &embree_ctx, &embree_ray);
+  // embree sets tfar to -inf for occluded rays
+  return embree_ray.tfar < 0;
+}
 #endif
 
 // primitive used to sort bvh entries
@@ -1553,6 +1571,140 @@ static bool intersect_instance_bvh(const trc::object* object, int instance,
       object->shape, inv_ray, element, uv, distance, find_any);
 }
 
+// Check whether a ray hits any primitive of a shape bvh. The larger child
+// is visited first, since it is the most likely to contain an occluder.
+static bool occluded_shape_bvh(trc::shape* shape, const ray3f& ray) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (shape->embree_bvh) return occluded_embree_bvh(shape->embree_bvh, ray);
+#endif
+
+  // get bvh and shape pointers for fast access
+  auto bvh = shape->bvh;
+
+  // check empty
+  if (bvh->nodes.empty()) return false;
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables, unused since we only check for hits
+  auto uv       = zero2f;
+  auto distance = 0.0f;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto area     = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // visit internal nodes, or stop at the first occluder
+    if (node.internal) {
+      auto left = node.start + 0, right = node.start + 1;
+      if (area(bvh->nodes[left].bbox) > area(bvh->nodes[right].bbox))
+        std::swap(left, right);
+      node_stack[node_cur++] = left;
+      node_stack[node_cur++] = right;
+    } else if (!shape->points.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& p = shape->points[bvh->primitives[idx].x];
+        if (intersect_point(
+                ray, shape->positions[p], shape->radius[p], uv, distance))
+          return true;
+      }
+    } else if (!shape->lines.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& l = shape->lines[bvh->primitives[idx].x];
+        if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+                shape->radius[l.x], shape->radius[l.y], uv, distance))
+          return true;
+      }
+    } else if (!shape->triangles.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& t = shape->triangles[bvh->primitives[idx].x];
+        if (intersect_triangle(ray, shape->positions[t.x],
+                shape->positions[t.y], shape->positions[t.z], uv, distance))
+          return true;
+      }
+    } else if (!shape->quads.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& q = shape->quads[bvh->primitives[idx].x];
+        if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
+                shape->positions[q.z], shape->positions[q.w], uv, distance))
+          return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+// Check whether a ray hits any object of the scene bvh.
+static bool occluded_scene_bvh(
+    const trc::scene* scene, const ray3f& ray, bool non_rigid_frames) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (scene->embree_bvh) return occluded_embree_bvh(scene->embree_bvh, ray);
+#endif
+
+  // get bvh and scene pointers for fast access
+  auto bvh = scene->bvh;
+
+  // check empty
+  if (bvh->nodes.empty()) return false;
+
+  // node stack
+  int  node_stack[128];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto area     = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // visit internal nodes, or stop at the first occluder
+    if (node.internal) {
+      auto left = node.start + 0, right = node.start + 1;
+      if (area(bvh->nodes[left].bbox) > area(bvh->nodes[right].bbox))
+        std::swap(left, right);
+      node_stack[node_cur++] = left;
+      node_stack[node_cur++] = right;
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto [object_id, instance_id] = bvh->primitives[idx];
+        auto object                   = scene->objects[object_id];
+        auto frame   = object->instance->frames[instance_id] * object->frame;
+        auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+        if (occluded_shape_bvh(object->shape, inv_ray)) return true;
+      }
+    }
+  }
+
+  return false;
+}
+
 intersection3f intersect_scene_bvh(const trc::scene* scene, const ray3f& ray,
     bool find_any, bool non_rigid_frames) {
   auto intersection = intersection3f{};
@@ -1570,6 +1722,12 @@ intersection3f intersect_instance_bvh(const trc::object* object, int instance,
   return intersection;
 }
 
+bool occluded(const trc::scene* scene, const ray3f& ray, float tmax,
+    bool non_rigid_frames) {
+  return occluded_scene_bvh(
+      scene, {ray.o, ray.d, ray.tmin, tmax}, non_rigid_frames);
+}
+
 }  // namespace yocto::trace
 
 // -----------------------------------------------------------------------------
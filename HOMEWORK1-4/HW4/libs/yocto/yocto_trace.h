@@ -517,6 +517,12 @@ intersection3f intersect_scene_bvh(const trc::scene* scene, const ray3f& ray,
 intersection3f intersect_instance_bvh(const trc::object* object, int instance,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Check whether a ray is occluded before the distance `tmax`. This is faster
+// than intersect_scene_bvh() with `find_any`, since it only reports whether
+// any occluder is found, and is meant for shadow rays.
+bool occluded(const trc::scene* scene, const ray3f& ray, float tmax,
+    bool non_rigid_frames = true);
+
 }  // namespace yocto::trace
 
 #endif
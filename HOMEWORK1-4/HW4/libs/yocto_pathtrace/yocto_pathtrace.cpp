@@ -31,12 +31,37 @@
 #include <yocto/yocto_shape.h>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <deque>
+#include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 using namespace std::string_literals;
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // MATH FUNCTIONS
 // -----------------------------------------------------------------------------
@@ -425,6 +450,16 @@ static brdf eval_brdf(const ptr::object* object, int element, const vec2f& uv,
   return brdf;
 }
 
+// Eval material opacity, as done by eval_brdf().
+static float eval_opacity(
+    const ptr::object* object, int element, const vec2f& uv) {
+  auto material = object->material;
+  auto texcoord = eval_texcoord(object, element, uv);
+  auto opacity  = material->opacity *
+                 mean(eval_texture(material->opacity_tex, texcoord, true));
+  return opacity > 0.999f ? 1 : opacity;
+}
+
 // check if a brdf is a delta
 static bool is_delta(const ptr::brdf& brdf) { return !brdf.roughness; }
 
@@ -482,6 +517,226 @@ static vec3f eval_environment(const ptr::scene* scene, const ray3f& ray) {
 
 }  // namespace yocto::pathtrace
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR PARALLEL HELPERS
+// -----------------------------------------------------------------------------
+namespace yocto::pathtrace {
+
+using std::atomic;
+using std::deque;
+using std::future;
+
+// Persistent pool of worker threads that run parallel loops, so that loops
+// do not create threads. The calling thread works as the first worker. Loop
+// indices are split in one contiguous range per worker. Workers take indices
+// from the front of their range, and when it is empty steal the back half of
+// the largest remaining range. Ranges are packed as begin and end in atomic
+// 64 bit integers, so taking and stealing are single compare and swaps.
+struct thread_pool {
+  thread_pool(int nthreads, bool affinity);
+  ~thread_pool();
+
+  // Runs `func(idx)` for all indices in [0, num) and waits for completion.
+  // Nested or concurrent loops wait for the pool.
+  void run(int num, const std::function<void(int)>& func);
+
+  int  nthreads = 1;
+  bool affinity = false;
+
+ private:
+  void work(int worker);
+  bool steal(int worker);
+
+  std::vector<std::thread>                 workers    = {};
+  std::unique_ptr<std::atomic<uint64_t>[]> ranges     = {};
+  const std::function<void(int)>*          job        = nullptr;
+  std::mutex                               run_mutex  = {};
+  std::mutex                               mutex      = {};
+  std::condition_variable                  start_cv   = {};
+  std::condition_variable                  done_cv    = {};
+  uint64_t                                 generation = 0;
+  int                                      running    = 0;
+  bool                                     quit       = false;
+};
+
+// Whether the current thread is running a pool loop, to run nested loops
+// serially instead of waiting for the pool.
+static thread_local bool thread_pool_worker = false;
+
+// Number of hardware threads, at least one since the count may be unknown.
+static int get_hardware_threads() {
+  return max((int)std::thread::hardware_concurrency(), 1);
+}
+
+static uint64_t pack_range(uint32_t begin, uint32_t end) {
+  return ((uint64_t)begin << 32) | end;
+}
+
+thread_pool::thread_pool(int nthreads_, bool affinity_)
+    : nthreads{max(nthreads_, 1)}, affinity{affinity_} {
+  ranges = std::make_unique<std::atomic<uint64_t>[]>(nthreads);
+  for (auto worker = 1; worker < nthreads; worker++) {
+    workers.emplace_back([this, worker]() {
+      auto seen = (uint64_t)0;
+      while (true) {
+        {
+          auto lock = std::unique_lock{mutex};
+          start_cv.wait(lock, [&] { return quit || generation != seen; });
+          if (quit) return;
+          seen = generation;
+        }
+        work(worker);
+        {
+          auto lock = std::lock_guard{mutex};
+          if (--running == 0) done_cv.notify_one();
+        }
+      }
+    });
+#ifdef __linux__
+    if (affinity) {
+      auto cpus = cpu_set_t{};
+      CPU_ZERO(&cpus);
+      CPU_SET(worker % get_hardware_threads(), &cpus);
+      pthread_setaffinity_np(
+          workers.back().native_handle(), sizeof(cpus), &cpus);
+    }
+#endif
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    auto lock = std::lock_guard{mutex};
+    quit      = true;
+  }
+  start_cv.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+void thread_pool::run(int num, const std::function<void(int)>& func) {
+  if (num <= 0) return;
+  if (nthreads == 1 || num == 1 || thread_pool_worker) {
+    for (auto idx = 0; idx < num; idx++) func(idx);
+    return;
+  }
+  auto run_lock = std::lock_guard{run_mutex};
+
+  // split indices and wake up workers
+  for (auto worker = 0; worker < nthreads; worker++) {
+    ranges[worker] = pack_range((uint32_t)((int64_t)num * worker / nthreads),
+        (uint32_t)((int64_t)num * (worker + 1) / nthreads));
+  }
+  {
+    auto lock = std::lock_guard{mutex};
+    job       = &func;
+    running   = nthreads - 1;
+    generation += 1;
+  }
+  start_cv.notify_all();
+
+  // work as the first worker and wait for the others
+  work(0);
+  auto lock = std::unique_lock{mutex};
+  done_cv.wait(lock, [this] { return running == 0; });
+  job = nullptr;
+}
+
+void thread_pool::work(int worker) {
+  thread_pool_worker = true;
+  auto& func         = *job;
+  do {
+    auto& range = ranges[worker];
+    auto  value = range.load();
+    while ((uint32_t)(value >> 32) < (uint32_t)value) {
+      auto begin = (uint32_t)(value >> 32), end = (uint32_t)value;
+      if (range.compare_exchange_weak(value, pack_range(begin + 1, end))) {
+        func((int)begin);
+        value = range.load();
+      }
+    }
+  } while (steal(worker));
+  thread_pool_worker = false;
+}
+
+bool thread_pool::steal(int worker) {
+  while (true) {
+    // find the largest remaining range
+    auto victim = -1;
+    auto size   = (uint32_t)0;
+    auto value  = (uint64_t)0;
+    for (auto other = 0; other < nthreads; other++) {
+      auto other_value = ranges[other].load();
+      auto begin = (uint32_t)(other_value >> 32), end = (uint32_t)other_value;
+      if (begin < end && end - begin > size) {
+        victim = other;
+        size   = end - begin;
+        value  = other_value;
+      }
+    }
+    if (victim < 0) return false;
+
+    // take its back half, retrying if it changed meanwhile
+    auto begin = (uint32_t)(value >> 32), end = (uint32_t)value;
+    auto mid   = begin + (end - begin) / 2;
+    if (ranges[victim].compare_exchange_strong(
+            value, pack_range(begin, mid))) {
+      ranges[worker] = pack_range(mid, end);
+      return true;
+    }
+  }
+}
+
+// Pool used by parallel loops. It uses all cores until configured. Loops
+// hold a reference to the pool while they run, so that it can be replaced
+// by another thread meanwhile, and is destroyed when the last loop ends.
+static std::shared_ptr<thread_pool> default_thread_pool = {};
+static std::mutex                   default_thread_pool_mutex;
+
+static std::shared_ptr<thread_pool> get_thread_pool() {
+  auto lock = std::lock_guard{default_thread_pool_mutex};
+  if (!default_thread_pool)
+    default_thread_pool = std::make_shared<thread_pool>(
+        get_hardware_threads(), false);
+  return default_thread_pool;
+}
+
+// Resize the pool used by parallel loops according to the params.
+static void init_thread_pool(const trace_params& params) {
+  auto nthreads = params.threads > 0 ? params.threads : get_hardware_threads();
+  auto lock     = std::lock_guard{default_thread_pool_mutex};
+  if (default_thread_pool && default_thread_pool->nthreads == nthreads &&
+      default_thread_pool->affinity == params.affinity)
+    return;
+  default_thread_pool = std::make_shared<thread_pool>(
+      nthreads, params.affinity);
+}
+
+// Simple parallel for used since our target platforms do not yet support
+// parallel algorithms. `Func` takes the integer index.
+template <typename Func>
+inline void parallel_for(int num, Func&& func) {
+  get_thread_pool()->run(num, [&func](int idx) { func(idx); });
+}
+
+// Simple parallel for used since our target platforms do not yet support
+// parallel algorithms. `Func` takes the integer index.
+template <typename Func>
+inline void parallel_for(const vec2i& size, Func&& func) {
+  get_thread_pool()->run(size.y, [&func, size](int j) {
+    for (auto i = 0; i < size.x; i++) func({i, j});
+  });
+}
+template <typename Func>
+inline void parallel_for(
+    const vec2i& size, std::atomic<bool>* stop, Func&& func) {
+  get_thread_pool()->run(size.y, [&func, size, stop](int j) {
+    if (stop && *stop) return;
+    for (auto i = 0; i < size.x; i++) func({i, j});
+  });
+}
+
+}  // namespace yocto::pathtrace
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR SHAPE/SCENE BVH
 // -----------------------------------------------------------------------------
@@ -494,16 +749,122 @@ struct bvh_primitive {
   int    primitive = 0;
 };
 
+// Minimum number of primitives for a node to be split using parallel scans
+// over its primitives. Smaller nodes are instead split in parallel with the
+// other nodes at the same tree level.
+const int bvh_parallel_prims = 16384;
+
+// Number of chunks used to scan a range of primitives.
+static int get_bvh_chunks(int start, int end, bool parallel) {
+  if (!parallel || end - start < bvh_parallel_prims) return 1;
+  return get_thread_pool()->nthreads;
+}
+
+// Range of a chunk of primitives.
+static vec2i get_bvh_chunk(int start, int end, int nchunks, int chunk) {
+  auto size = (int64_t)(end - start);
+  return {start + (int)(size * chunk / nchunks),
+      start + (int)(size * (chunk + 1) / nchunks)};
+}
+
+// Run `func(chunk, chunk_start, chunk_end)` over chunks of a primitive range.
+template <typename Func>
+static void parallel_chunks(int start, int end, int nchunks, Func&& func) {
+  auto run_chunk = [&func, start, end, nchunks](int chunk) {
+    auto range = get_bvh_chunk(start, end, nchunks, chunk);
+    func(chunk, range.x, range.y);
+  };
+  if (nchunks == 1) {
+    run_chunk(0);
+  } else {
+    parallel_for(nchunks, run_chunk);
+  }
+}
+
+// Computes the bounds and the centroid bounds of a range of primitives.
+static std::pair<bbox3f, bbox3f> compute_bounds(
+    const std::vector<bvh_primitive>& primitives, int start, int end,
+    bool parallel) {
+  auto nchunks = get_bvh_chunks(start, end, parallel);
+  auto bboxes  = std::vector<bbox3f>(nchunks, invalidb3f);
+  auto cbboxes = std::vector<bbox3f>(nchunks, invalidb3f);
+  parallel_chunks(start, end, nchunks,
+      [&primitives, &bboxes, &cbboxes](int chunk, int cstart, int cend) {
+        for (auto i = cstart; i < cend; i++) {
+          bboxes[chunk]  = merge(bboxes[chunk], primitives[i].bbox);
+          cbboxes[chunk] = merge(cbboxes[chunk], primitives[i].center);
+        }
+      });
+  auto bbox = invalidb3f, cbbox = invalidb3f;
+  for (auto chunk = 0; chunk < nchunks; chunk++) {
+    bbox  = merge(bbox, bboxes[chunk]);
+    cbbox = merge(cbbox, cbboxes[chunk]);
+  }
+  return {bbox, cbbox};
+}
+
+// Partitions a range of primitives according to a predicate. Returns the
+// partition point. Large ranges are partitioned stably in parallel chunks.
+template <typename Pred>
+static int partition_primitives(std::vector<bvh_primitive>& primitives,
+    int start, int end, bool parallel, Pred&& pred) {
+  auto nchunks = get_bvh_chunks(start, end, parallel);
+  if (nchunks == 1) {
+    return (int)(std::partition(primitives.data() + start,
+                     primitives.data() + end, pred) -
+                 primitives.data());
+  }
+
+  // count the primitives that go left in each chunk
+  auto counts = std::vector<int>(nchunks, 0);
+  parallel_chunks(start, end, nchunks,
+      [&primitives, &counts, &pred](int chunk, int cstart, int cend) {
+        for (auto i = cstart; i < cend; i++) {
+          if (pred(primitives[i])) counts[chunk] += 1;
+        }
+      });
+
+  // compute where each chunk writes its left and right primitives
+  auto mid = start;
+  for (auto count : counts) mid += count;
+  auto lefts = std::vector<int>(nchunks), rights = std::vector<int>(nchunks);
+  auto left = start, right = mid;
+  for (auto chunk = 0; chunk < nchunks; chunk++) {
+    auto range    = get_bvh_chunk(start, end, nchunks, chunk);
+    lefts[chunk]  = left;
+    rights[chunk] = right;
+    left += counts[chunk];
+    right += range.y - range.x - counts[chunk];
+  }
+
+  // scatter primitives from a copy of the range
+  auto source = std::vector<bvh_primitive>(
+      primitives.begin() + start, primitives.begin() + end);
+  parallel_chunks(start, end, nchunks,
+      [&primitives, &source, &lefts, &rights, &pred, start](
+          int chunk, int cstart, int cend) {
+        auto left = lefts[chunk], right = rights[chunk];
+        for (auto i = cstart; i < cend; i++) {
+          auto& primitive = source[i - start];
+          if (pred(primitive)) {
+            primitives[left++] = primitive;
+          } else {
+            primitives[right++] = primitive;
+          }
+        }
+      });
+
+  return mid;
+}
+
 // Splits a BVH node. Returns split position and axis.
-static std::pair<int, int> split_middle(
-    std::vector<bvh_primitive>& primitives, int start, int end) {
+static std::pair<int, int> split_middle(std::vector<bvh_primitive>& primitives,
+    int start, int end, const bbox3f& cbbox, bool parallel) {
   // initialize split axis and position
   auto axis = 0;
   auto mid  = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++) cbbox = merge(cbbox, primitives[i].center);
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, axis};
 
@@ -513,11 +874,10 @@ static std::pair<int, int> split_middle(
   if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
 
   // split the space in the middle along the largest axis
-  mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [axis, middle = center(cbbox)[axis]](auto& primitive) {
-                    return primitive.center[axis] < middle;
-                  }) -
-              primitives.data());
+  mid = partition_primitives(primitives, start, end, parallel,
+      [axis, middle = center(cbbox)[axis]](auto& primitive) {
+        return primitive.center[axis] < middle;
+      });
 
   // if we were not able to split, just break the primitives in half
   if (mid == start || mid == end) {
@@ -531,161 +891,1739 @@ static std::pair<int, int> split_middle(
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
-// Build BVH nodes
-static void build_bvh(
-    std::vector<bvh_node>& nodes, std::vector<bvh_primitive>& primitives) {
+// Number of bins and maximum number of primitives per leaf used by the SAH
+// builder. Leaves are made as soon as splitting does not reduce the cost.
+const int bvh_sah_bins      = 16;
+const int bvh_sah_max_prims = 16;
+
+// Cost of traversing a node relative to intersecting a primitive.
+const float bvh_sah_traversal_cost = 1;
+
+// Surface area of a bounding box, zero for empty boxes.
+static float bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  if (size.x < 0 || size.y < 0 || size.z < 0) return 0;
+  return 2 * (size.x * size.y + size.x * size.z + size.y * size.z);
+}
+
+// Primitive bins along the three axes used by the SAH builder.
+struct bvh_bins {
+  bbox3f bbox[3][bvh_sah_bins]  = {};
+  int    count[3][bvh_sah_bins] = {};
+};
+
+// Splits a BVH node using a binned SAH. Returns split position and axis.
+// A split position equal to `end` means that a leaf is cheaper than any split.
+static std::pair<int, int> split_sah(std::vector<bvh_primitive>& primitives,
+    int start, int end, const bbox3f& bbox, const bbox3f& cbbox,
+    bool parallel) {
+  // initialize split axis and position
+  auto nprims = end - start;
+  auto axis   = 0;
+  auto mid    = (start + end) / 2;
+
+  // compute primintive bounds and size
+  auto csize = cbbox.max - cbbox.min;
+  if (csize == zero3f) return {nprims <= bvh_sah_max_prims ? end : mid, axis};
+
+  // bin index of a primitive center along an axis
+  auto get_bin = [&cbbox, &csize](const vec3f& center, int axis) {
+    if (csize[axis] == 0) return 0;
+    auto bin = (int)(bvh_sah_bins * (center[axis] - cbbox.min[axis]) /
+                     csize[axis]);
+    return clamp(bin, 0, bvh_sah_bins - 1);
+  };
+
+  // bin primitives along each axis
+  auto nchunks = get_bvh_chunks(start, end, parallel);
+  auto cbins   = std::vector<bvh_bins>(nchunks);
+  parallel_chunks(start, end, nchunks,
+      [&primitives, &cbins, &get_bin](int chunk, int cstart, int cend) {
+        auto& bins = cbins[chunk];
+        for (auto i = cstart; i < cend; i++) {
+          for (auto saxis = 0; saxis < 3; saxis++) {
+            auto bin = get_bin(primitives[i].center, saxis);
+            bins.bbox[saxis][bin] = merge(
+                bins.bbox[saxis][bin], primitives[i].bbox);
+            bins.count[saxis][bin] += 1;
+          }
+        }
+      });
+  auto& bins = cbins[0];
+  for (auto chunk = 1; chunk < nchunks; chunk++) {
+    for (auto saxis = 0; saxis < 3; saxis++) {
+      for (auto b = 0; b < bvh_sah_bins; b++) {
+        bins.bbox[saxis][b] = merge(
+            bins.bbox[saxis][b], cbins[chunk].bbox[saxis][b]);
+        bins.count[saxis][b] += cbins[chunk].count[saxis][b];
+      }
+    }
+  }
+
+  // sweep the bins to find the best split
+  auto node_area  = max(bbox_area(bbox), 1e-12f);
+  auto best_cost  = flt_max;
+  auto best_split = 0;
+  for (auto saxis = 0; saxis < 3; saxis++) {
+    if (csize[saxis] == 0) continue;
+    // right sweep stores the cost of the primitives at or after each bin
+    float right_cost[bvh_sah_bins];
+    auto  right_bbox = invalidb3f;
+    auto  right_num  = 0;
+    for (auto b = bvh_sah_bins - 1; b > 0; b--) {
+      right_bbox    = merge(right_bbox, bins.bbox[saxis][b]);
+      right_num     = right_num + bins.count[saxis][b];
+      right_cost[b] = right_num * bbox_area(right_bbox);
+    }
+    // left sweep combines costs
+    auto left_bbox = invalidb3f;
+    auto left_num  = 0;
+    for (auto b = 1; b < bvh_sah_bins; b++) {
+      left_bbox = merge(left_bbox, bins.bbox[saxis][b - 1]);
+      left_num += bins.count[saxis][b - 1];
+      if (left_num == 0 || left_num == nprims) continue;
+      auto cost = bvh_sah_traversal_cost +
+                  (left_num * bbox_area(left_bbox) + right_cost[b]) / node_area;
+      if (cost < best_cost) {
+        best_cost  = cost;
+        best_split = b;
+        axis       = saxis;
+      }
+    }
+  }
+
+  // make a leaf if it costs less than splitting
+  if (nprims <= bvh_sah_max_prims && nprims <= best_cost) return {end, axis};
+
+  // if we were not able to split, just break the primitives in half
+  if (best_cost == flt_max) return {mid, axis};
+
+  // split
+  mid = partition_primitives(primitives, start, end, parallel,
+      [&get_bin, axis, best_split](auto& primitive) {
+        return get_bin(primitive.center, axis) < best_split;
+      });
+
+  return {mid, axis};
+}
+
+// Split bvh nodes according to a type. Returns split position and axis.
+// A split position equal to `end` means that the node should be a leaf.
+static std::pair<int, int> split_nodes(std::vector<bvh_primitive>& primitives,
+    int start, int end, const bbox3f& bbox, const bbox3f& cbbox, bvh_type type,
+    bool parallel) {
+  switch (type) {
+    case bvh_type::middle:
+      if (end - start <= bvh_max_prims) return {end, 0};
+      return split_middle(primitives, start, end, cbbox, parallel);
+    case bvh_type::sah:
+    case bvh_type::sbvh:
+      return split_sah(primitives, start, end, bbox, cbbox, parallel);
+    default: throw std::runtime_error("should not have gotten here");
+  }
+}
+
+// Maximum depth of bvh nodes split by the builders. Deeper nodes are split at
+// the median, so that degenerate meshes only add the logarithm of their size
+// to the depth, which stays within the traversal stacks.
+const int bvh_max_depth = 64;
+
+// Maximum depth of the binary bvhs made by the builders, since median splits
+// past bvh_max_depth halve the primitives of each node. Wide, compact and
+// quantized bvhs are made from binary ones and are not deeper.
+const int bvh_max_tree_depth = bvh_max_depth + 32;
+
+// Maximum number of entries in the traversal stack of binary bvhs, also used
+// for compact, quantized and packet traversals. These push at most the two
+// children of the node they pop, so they hold one entry per level plus one.
+const int bvh_binary_stack = 128;
+static_assert(bvh_binary_stack >= bvh_max_tree_depth + 1,
+    "binary bvh stack smaller than the bvh depth");
+
+// Splits a BVH node at the median of the primitive centers along the largest
+// axis. Returns split position and axis.
+static std::pair<int, int> split_median(std::vector<bvh_primitive>& primitives,
+    int start, int end, const bbox3f& cbbox) {
+  // make leaves for small nodes
+  if (end - start <= bvh_max_prims) return {end, 0};
+
+  // split along largest
+  auto csize = cbbox.max - cbbox.min;
+  auto axis  = 0;
+  if (csize.y > csize[axis]) axis = 1;
+  if (csize.z > csize[axis]) axis = 2;
+
+  // partition around the median
+  auto mid = (start + end) / 2;
+  std::nth_element(primitives.begin() + start, primitives.begin() + mid,
+      primitives.begin() + end, [axis](auto& a, auto& b) {
+        return a.center[axis] < b.center[axis];
+      });
+  return {mid, axis};
+}
+
+// Build BVH nodes. Nodes are built one tree level at a time. Nodes within a
+// level are independent, so they are split in parallel, or with parallel scans
+// when the level has few nodes, while children are allocated in order to
+// keep the breadth-first layout of a serial build.
+static void build_bvh(bvh_vector<bvh_node>& nodes,
+    std::vector<bvh_primitive>& primitives, bvh_type type, bool parallel) {
   // prepare to build nodes
   nodes.clear();
   nodes.reserve(primitives.size() * 2);
 
   // queue up first node
-  auto queue = std::deque<vec3i>{{0, 0, (int)primitives.size()}};
+  auto level = std::vector<vec3i>{{0, 0, (int)primitives.size()}};
   nodes.emplace_back();
 
-  // create nodes until the queue is empty
-  while (!queue.empty()) {
-    // grab node to work on
-    auto next = queue.front();
-    queue.pop_front();
-    auto nodeid = next.x, start = next.y, end = next.z;
-
-    // grab node
-    auto& node = nodes[nodeid];
-
-    // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, primitives[i].bbox);
-
-    // split into two children
-    if (end - start > bvh_max_prims) {
-      // get split
-      auto [mid, axis] = split_middle(primitives, start, end);
-
-      // make an internal node
-      node.internal = true;
-      node.axis     = axis;
-      node.num      = 2;
-      node.start    = (int)nodes.size();
-      nodes.emplace_back();
-      nodes.emplace_back();
-      queue.push_back({node.start + 0, start, mid});
-      queue.push_back({node.start + 1, mid, end});
+  // split nodes level by level
+  auto splits   = std::vector<vec2i>{};
+  auto next     = std::vector<vec3i>{};
+  auto nthreads = get_thread_pool()->nthreads;
+  for (auto depth = 0; !level.empty(); depth++) {
+    // split a node and compute its bounds
+    splits.resize(level.size());
+    auto split_node = [&](int idx, bool parallel_scans) {
+      auto  nodeid = level[idx].x, start = level[idx].y, end = level[idx].z;
+      auto& node   = nodes[nodeid];
+      auto [bbox, cbbox] = compute_bounds(
+          primitives, start, end, parallel_scans);
+      node.bbox        = bbox;
+      auto [mid, axis] =
+          depth < bvh_max_depth
+              ? split_nodes(
+                    primitives, start, end, bbox, cbbox, type, parallel_scans)
+              : split_median(primitives, start, end, cbbox);
+      splits[idx] = {mid, axis};
+    };
+    if (parallel && level.size() >= nthreads) {
+      parallel_for((int)level.size(),
+          [&split_node](int idx) { split_node(idx, false); });
     } else {
-      // Make a leaf node
-      node.internal = false;
-      node.num      = end - start;
-      node.start    = start;
+      for (auto idx = 0; idx < level.size(); idx++) split_node(idx, parallel);
+    }
+
+    // create children in order
+    next.clear();
+    for (auto idx = 0; idx < level.size(); idx++) {
+      auto  nodeid = level[idx].x, start = level[idx].y, end = level[idx].z;
+      auto  mid = splits[idx].x, axis = splits[idx].y;
+      auto& node = nodes[nodeid];
+      if (mid != start && mid != end) {
+        // make an internal node
+        node.internal = true;
+        node.axis     = axis;
+        node.num      = 2;
+        node.start    = (int)nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        next.push_back({node.start + 0, start, mid});
+        next.push_back({node.start + 1, mid, end});
+      } else {
+        // Make a leaf node
+        node.internal = false;
+        node.num      = end - start;
+        node.start    = start;
+      }
     }
+    std::swap(level, next);
   }
 
   // cleanup
   nodes.shrink_to_fit();
 }
 
-static void init_bvh(ptr::shape* shape, const trace_params& params) {
-  // build primitives
-  auto primitives = std::vector<bvh_primitive>{};
-  if (!shape->points.empty()) {
-    for (auto idx = 0; idx < shape->points.size(); idx++) {
-      auto& p             = shape->points[idx];
-      auto& primitive     = primitives.emplace_back();
-      primitive.bbox      = point_bounds(shape->positions[p], shape->radius[p]);
-      primitive.center    = center(primitive.bbox);
-      primitive.primitive = idx;
-    }
-  } else if (!shape->lines.empty()) {
-    for (auto idx = 0; idx < shape->lines.size(); idx++) {
-      auto& l         = shape->lines[idx];
-      auto& primitive = primitives.emplace_back();
-      primitive.bbox = line_bounds(shape->positions[l.x], shape->positions[l.y],
-          shape->radius[l.x], shape->radius[l.y]);
-      primitive.center    = center(primitive.bbox);
-      primitive.primitive = idx;
-    }
-  } else if (!shape->triangles.empty()) {
-    for (auto idx = 0; idx < shape->triangles.size(); idx++) {
-      auto& primitive = primitives.emplace_back();
-      auto& t         = shape->triangles[idx];
-      primitive.bbox  = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
-      primitive.center    = center(primitive.bbox);
-      primitive.primitive = idx;
+// Spatial splits are tried only when the children of the best object split
+// overlap by more than this fraction of the root area. References are
+// duplicated at most up to this fraction of the number of primitives.
+const float bvh_sbvh_min_overlap     = 1e-5f;
+const float bvh_sbvh_max_duplicates = 0.3f;
+
+// Bounds of the part of a primitive reference between two planes along an
+// axis. Triangles are clipped exactly, while other primitives use their bounds.
+static bbox3f clip_primitive(const ptr::shape* shape,
+    const bvh_primitive& primitive, int axis, float lo, float hi) {
+  auto bbox = invalidb3f;
+  if (!shape->triangles.empty()) {
+    auto& t         = shape->triangles[primitive.primitive];
+    vec3f points[3] = {
+        shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]};
+    for (auto idx = 0; idx < 3; idx++) {
+      auto& a = points[idx];
+      auto& b = points[(idx + 1) % 3];
+      if (a[axis] >= lo && a[axis] <= hi) bbox = merge(bbox, a);
+      for (auto plane : {lo, hi}) {
+        if ((a[axis] < plane && b[axis] > plane) ||
+            (a[axis] > plane && b[axis] < plane)) {
+          auto p  = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+          p[axis] = plane;
+          bbox    = merge(bbox, p);
+        }
+      }
     }
+  } else {
+    bbox = primitive.bbox;
   }
+  bbox.min       = max(bbox.min, primitive.bbox.min);
+  bbox.max       = min(bbox.max, primitive.bbox.max);
+  bbox.min[axis] = max(bbox.min[axis], lo);
+  bbox.max[axis] = min(bbox.max[axis], hi);
+  return bbox;
+}
 
-  // build nodes
-  if (shape->bvh) delete shape->bvh;
-  shape->bvh = new bvh_tree{};
-  build_bvh(shape->bvh->nodes, primitives);
+// Reference bins along the three axes used by spatial splits, with the
+// number of references that start and end in each bin.
+struct bvh_spatial_bins {
+  bbox3f bbox[3][bvh_sah_bins]  = {};
+  int    enter[3][bvh_sah_bins] = {};
+  int    exit[3][bvh_sah_bins]  = {};
+};
 
-  // set bvh primitives
-  shape->bvh->primitives.reserve(primitives.size());
-  for (auto& primitive : primitives) {
-    shape->bvh->primitives.push_back(primitive.primitive);
+// Finds the best spatial split of a node by clipping references to bins.
+// Returns the split cost, axis and plane position.
+static std::tuple<float, int, float> split_spatial(const ptr::shape* shape,
+    const std::vector<bvh_primitive>& primitives, const bbox3f& bbox) {
+  // bin references, clipping them to the bins they overlap
+  auto size = bbox.max - bbox.min;
+  auto bins = bvh_spatial_bins{};
+  auto get_bin = [&bbox, &size](float value, int axis) {
+    auto bin = (int)(bvh_sah_bins * (value - bbox.min[axis]) / size[axis]);
+    return clamp(bin, 0, bvh_sah_bins - 1);
+  };
+  for (auto axis = 0; axis < 3; axis++) {
+    if (size[axis] <= 0) continue;
+    auto width = size[axis] / bvh_sah_bins;
+    for (auto& primitive : primitives) {
+      auto first = get_bin(primitive.bbox.min[axis], axis);
+      auto last  = get_bin(primitive.bbox.max[axis], axis);
+      for (auto b = first; b <= last; b++) {
+        auto lo = b == 0 ? bbox.min[axis] : bbox.min[axis] + width * b;
+        auto hi = b == bvh_sah_bins - 1 ? bbox.max[axis]
+                                        : bbox.min[axis] + width * (b + 1);
+        bins.bbox[axis][b] = merge(
+            bins.bbox[axis][b], clip_primitive(shape, primitive, axis, lo, hi));
+      }
+      bins.enter[axis][first] += 1;
+      bins.exit[axis][last] += 1;
+    }
   }
-}
-
-void init_bvh(ptr::scene* scene, const trace_params& params,
-    progress_callback progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
 
-  // shapes
-  for (auto idx = 0; idx < scene->shapes.size(); idx++) {
-    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
-    init_bvh(scene->shapes[idx], params);
+  // sweep the bins to find the best split
+  auto node_area  = max(bbox_area(bbox), 1e-12f);
+  auto best_cost  = flt_max;
+  auto best_axis  = 0;
+  auto best_plane = 0.0f;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (size[axis] <= 0) continue;
+    // right sweep stores the cost of the references at or after each bin
+    float right_cost[bvh_sah_bins];
+    auto  right_bbox = invalidb3f;
+    auto  right_num  = 0;
+    for (auto b = bvh_sah_bins - 1; b > 0; b--) {
+      right_bbox    = merge(right_bbox, bins.bbox[axis][b]);
+      right_num     = right_num + bins.exit[axis][b];
+      right_cost[b] = right_num * bbox_area(right_bbox);
+    }
+    // left sweep combines costs
+    auto left_bbox = invalidb3f;
+    auto left_num  = 0;
+    for (auto b = 1; b < bvh_sah_bins; b++) {
+      left_bbox = merge(left_bbox, bins.bbox[axis][b - 1]);
+      left_num += bins.enter[axis][b - 1];
+      if (left_num == 0 || right_cost[b] == 0) continue;
+      auto cost = bvh_sah_traversal_cost +
+                  (left_num * bbox_area(left_bbox) + right_cost[b]) / node_area;
+      if (cost < best_cost) {
+        best_cost  = cost;
+        best_axis  = axis;
+        best_plane = bbox.min[axis] + size[axis] / bvh_sah_bins * b;
+      }
+    }
   }
 
-  // handle progress
-  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
+  return {best_cost, best_axis, best_plane};
+}
 
-  // instance bboxes
-  auto primitives = std::vector<bvh_primitive>{};
-  auto object_id  = 0;
-  for (auto object : scene->objects) {
-    auto& primitive = primitives.emplace_back();
-    primitive.bbox =
-        object->shape->bvh->nodes.empty()
-            ? invalidb3f
-            : transform_bbox(object->frame, object->shape->bvh->nodes[0].bbox);
-    primitive.center    = center(primitive.bbox);
-    primitive.primitive = object_id++;
-  }
+// Build BVH nodes with spatial splits (SBVH). Nodes are split with the
+// cheapest of the best SAH object split and, if its children overlap, the
+// best spatial split, which duplicates references crossing the split plane.
+// On return, primitives contains the references in leaf order.
+static void build_sbvh(bvh_vector<bvh_node>& nodes,
+    std::vector<bvh_primitive>& primitives, const ptr::shape* shape) {
+  // prepare to build nodes
+  nodes.clear();
+  nodes.reserve(primitives.size() * 2);
+  auto references = std::vector<bvh_primitive>{};
+  references.reserve(primitives.size());
+
+  // limit duplicated references
+  auto max_references = (size_t)(
+      primitives.size() * (1 + bvh_sbvh_max_duplicates));
+  auto num_references = primitives.size();
+
+  // stack of nodes to split, with their depth and references
+  auto root_area = 0.0f;
+  auto stack =
+      std::vector<std::tuple<int, int, std::vector<bvh_primitive>>>{};
+  stack.push_back({0, 0, std::move(primitives)});
+  nodes.emplace_back();
 
-  // build nodes
-  if (scene->bvh) delete scene->bvh;
-  scene->bvh = new bvh_tree{};
-  build_bvh(scene->bvh->nodes, primitives);
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, depth, node_primitives] = std::move(stack.back());
+    stack.pop_back();
+    auto nprims = (int)node_primitives.size();
+
+    // compute bounds and try the object split
+    auto [bbox, cbbox] = compute_bounds(node_primitives, 0, nprims, false);
+    if (nodeid == 0) root_area = max(bbox_area(bbox), 1e-12f);
+    auto [mid, axis] =
+        depth < bvh_max_depth
+            ? split_sah(node_primitives, 0, nprims, bbox, cbbox, false)
+            : split_median(node_primitives, 0, nprims, cbbox);
+    nodes[nodeid].bbox = bbox;
+
+    // make a leaf if it costs less than splitting
+    if (mid == nprims || nprims <= 1) {
+      auto& node    = nodes[nodeid];
+      node.internal = false;
+      node.num      = (short)nprims;
+      node.start    = (int)references.size();
+      references.insert(
+          references.end(), node_primitives.begin(), node_primitives.end());
+      continue;
+    }
 
-  // set bvh primitives
-  scene->bvh->primitives.reserve(primitives.size());
-  for (auto& primitive : primitives) {
-    scene->bvh->primitives.push_back(primitive.primitive);
+    // try a spatial split if the object split children overlap
+    auto left  = std::vector<bvh_primitive>{};
+    auto right = std::vector<bvh_primitive>{};
+    auto left_bbox  = compute_bounds(node_primitives, 0, mid, false).first;
+    auto right_bbox = compute_bounds(node_primitives, mid, nprims, false).first;
+    auto overlap    = bbox3f{max(left_bbox.min, right_bbox.min),
+        min(left_bbox.max, right_bbox.max)};
+    auto node_area   = max(bbox_area(bbox), 1e-12f);
+    auto object_cost = bvh_sah_traversal_cost +
+                       (mid * bbox_area(left_bbox) +
+                           (nprims - mid) * bbox_area(right_bbox)) /
+                           node_area;
+    auto spatial = false;
+    if (depth < bvh_max_depth && num_references < max_references &&
+        bbox_area(overlap) / root_area > bvh_sbvh_min_overlap) {
+      auto [spatial_cost, spatial_axis, plane] = split_spatial(
+          shape, node_primitives, bbox);
+      if (spatial_cost < object_cost) {
+        // split references, duplicating the ones crossing the plane
+        for (auto& primitive : node_primitives) {
+          if (primitive.bbox.max[spatial_axis] <= plane) {
+            left.push_back(primitive);
+          } else if (primitive.bbox.min[spatial_axis] >= plane) {
+            right.push_back(primitive);
+          } else {
+            auto lbbox = clip_primitive(
+                shape, primitive, spatial_axis, -flt_max, plane);
+            auto rbbox = clip_primitive(
+                shape, primitive, spatial_axis, plane, flt_max);
+            for (auto [side, side_bbox] :
+                {std::pair{&left, lbbox}, std::pair{&right, rbbox}}) {
+              if (side_bbox.min.x > side_bbox.max.x ||
+                  side_bbox.min.y > side_bbox.max.y ||
+                  side_bbox.min.z > side_bbox.max.z)
+                continue;
+              auto& reference  = side->emplace_back(primitive);
+              reference.bbox   = side_bbox;
+              reference.center = center(side_bbox);
+            }
+          }
+        }
+        // accept the split only if it separates references
+        if (!left.empty() && !right.empty() &&
+            num_references + left.size() + right.size() - nprims <=
+                max_references) {
+          spatial = true;
+          axis    = spatial_axis;
+          num_references += left.size() + right.size() - nprims;
+        } else {
+          left.clear();
+          right.clear();
+        }
+      }
+    }
+    if (!spatial) {
+      left.assign(node_primitives.begin(), node_primitives.begin() + mid);
+      right.assign(node_primitives.begin() + mid, node_primitives.end());
+    }
+    node_primitives = {};
+
+    // make an internal node, with children after their parent
+    auto& node    = nodes[nodeid];
+    node.internal = true;
+    node.axis     = (byte)axis;
+    node.num      = 2;
+    node.start    = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    stack.push_back({node.start + 1, depth + 1, std::move(right)});
+    stack.push_back({node.start + 0, depth + 1, std::move(left)});
   }
 
-  // handle progress
-  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+  // cleanup
+  primitives = std::move(references);
+  nodes.shrink_to_fit();
 }
 
-// Intersect ray with a bvh->
-static bool intersect_shape_bvh(ptr::shape* shape, const ray3f& ray_,
-    int& element, vec2f& uv, float& distance, bool find_any) {
-  // get bvh and shape pointers for fast access
-  auto bvh = shape->bvh;
+// Reorder a binary bvh depth-first over sibling pairs, placing the pair of
+// children of the larger child right after its parent pair. An unused node
+// follows the root, so that with 32 byte nodes each pair of siblings lies
+// in a single 64 byte cache line. Children still follow their parents.
+static void reorder_bvh(bvh_vector<bvh_node>& nodes) {
+  // prepare to reorder nodes
+  if (nodes.empty() || !nodes[0].internal) return;
+  auto reordered = bvh_vector<bvh_node>{};
+  reordered.reserve(nodes.size() + 1);
+  reordered.push_back(nodes[0]);
+  reordered.emplace_back();
+
+  // stack of children to place, with the reordered parent to link
+  auto stack = std::vector<vec2i>{{nodes[0].start, 0}};
+  while (!stack.empty()) {
+    auto [start, parentid] = stack.back();
+    stack.pop_back();
+    auto pairid               = (int)reordered.size();
+    reordered[parentid].start = pairid;
+    reordered.push_back(nodes[start + 0]);
+    reordered.push_back(nodes[start + 1]);
+    auto larger = bbox_area(nodes[start + 1].bbox) >
+                          bbox_area(nodes[start + 0].bbox)
+                      ? 1
+                      : 0;
+    for (auto idx : {1 - larger, larger}) {
+      if (nodes[start + idx].internal)
+        stack.push_back({nodes[start + idx].start, pairid + idx});
+    }
+  }
 
-  // check empty
-  if (bvh->nodes.empty()) return false;
+  // cleanup
+  nodes = std::move(reordered);
+}
 
-  // node stack
-  int  node_stack[128];
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+// Collapse a binary bvh into a wide bvh with N children per node. Each wide
+// node repeatedly opens its internal child with the largest surface area
+// until it has N children, so the wide tree has the same leaves.
+template <int N>
+static void collapse_bvh(bvh_vector<bvh_wide_node<N>>& wnodes,
+    const bvh_vector<bvh_node>& nodes) {
+  // prepare to build nodes
+  wnodes.clear();
+  if (nodes.empty()) return;
+  wnodes.reserve(nodes.size() / 2 + 1);
 
-  // shared variables
-  auto hit = false;
+  // queue up the root, with binary and wide node ids
+  auto queue = std::deque<vec2i>{{0, 0}};
+  wnodes.emplace_back();
 
-  // copy ray to modify it
+  // create nodes until the queue is empty
+  while (!queue.empty()) {
+    // grab node to work on
+    auto next = queue.front();
+    queue.pop_front();
+    auto nodeid = next.x, wnodeid = next.y;
+
+    // gather children opening the largest internal ones
+    int  children[N];
+    auto nchildren = 0;
+    auto& node      = nodes[nodeid];
+    if (node.internal) {
+      children[nchildren++] = node.start + 0;
+      children[nchildren++] = node.start + 1;
+    } else {
+      children[nchildren++] = nodeid;
+    }
+    while (nchildren < N) {
+      auto largest = -1;
+      auto area    = -1.0f;
+      for (auto idx = 0; idx < nchildren; idx++) {
+        auto& child = nodes[children[idx]];
+        if (child.internal && bbox_area(child.bbox) > area) {
+          largest = idx;
+          area    = bbox_area(child.bbox);
+        }
+      }
+      if (largest < 0) break;
+      auto& child           = nodes[children[largest]];
+      children[largest]     = child.start + 0;
+      children[nchildren++] = child.start + 1;
+    }
+
+    // set children, with empty bounds for unused ones
+    for (auto idx = 0; idx < N; idx++) {
+      auto  bbox  = invalidb3f;
+      auto  start = 0;
+      short num   = 0;
+      if (idx < nchildren && nodes[children[idx]].internal) {
+        bbox  = nodes[children[idx]].bbox;
+        start = (int)wnodes.size();
+        queue.push_back({children[idx], start});
+        wnodes.emplace_back();
+      } else if (idx < nchildren && nodes[children[idx]].num) {
+        bbox  = nodes[children[idx]].bbox;
+        start = nodes[children[idx]].start;
+        num   = nodes[children[idx]].num;
+      }
+      auto& wnode = wnodes[wnodeid];
+      for (auto axis = 0; axis < 3; axis++) {
+        wnode.bbox[axis + 0][idx] = bbox.min[axis];
+        wnode.bbox[axis + 3][idx] = bbox.max[axis];
+      }
+      wnode.start[idx] = start;
+      wnode.num[idx]   = num;
+    }
+  }
+
+  // cleanup
+  wnodes.shrink_to_fit();
+}
+
+// Reorder a binary bvh depth-first, so that the left child of each internal
+// node follows it and only the right child index is stored.
+static void compact_bvh(bvh_vector<bvh_compact_node>& cnodes,
+    const bvh_vector<bvh_node>& nodes) {
+  // prepare to build nodes
+  cnodes.clear();
+  if (nodes.empty()) return;
+  cnodes.reserve(nodes.size());
+
+  // stack of binary node ids, with the compact parent to link as right child
+  auto stack = std::vector<vec2i>{{0, -1}};
+  while (!stack.empty()) {
+    auto [nodeid, parentid] = stack.back();
+    stack.pop_back();
+    auto  cnodeid = (int)cnodes.size();
+    auto& node    = nodes[nodeid];
+    if (parentid >= 0) cnodes[parentid].start = cnodeid;
+    auto& cnode    = cnodes.emplace_back();
+    cnode.bbox     = node.bbox;
+    cnode.internal = node.internal;
+    cnode.axis     = node.axis;
+    if (node.internal) {
+      stack.push_back({node.start + 1, cnodeid});
+      stack.push_back({node.start + 0, -1});
+    } else {
+      cnode.start = node.start;
+      cnode.num   = (unsigned short)node.num;
+    }
+  }
+}
+
+// Decode the bounds of a quantized node from the bounds of its parent.
+static bbox3f dequantize_bbox(
+    const bvh_quantized_node& node, const bbox3f& parent) {
+  auto scale = (parent.max - parent.min) / 255;
+  return {parent.min + vec3f{(float)node.qmin[0], (float)node.qmin[1],
+                           (float)node.qmin[2]} *
+                           scale,
+      parent.min +
+          vec3f{(float)node.qmax[0], (float)node.qmax[1], (float)node.qmax[2]} *
+              scale};
+}
+
+// Quantize bounds in the bounds of the parent, rounding outward so that the
+// decoded bounds always contain the original ones.
+static void quantize_bbox(
+    bvh_quantized_node& node, const bbox3f& bbox, const bbox3f& parent) {
+  auto size = parent.max - parent.min;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto qmin = size[axis] > 0 ? (bbox.min[axis] - parent.min[axis]) /
+                                     size[axis] * 255
+                               : 0.0f;
+    auto qmax = size[axis] > 0 ? (bbox.max[axis] - parent.min[axis]) /
+                                     size[axis] * 255
+                               : 0.0f;
+    node.qmin[axis] = (byte)clamp((int)floor(qmin), 0, 255);
+    node.qmax[axis] = (byte)clamp((int)ceil(qmax), 0, 255);
+  }
+  // fix rounding errors of the decoding
+  for (auto axis = 0; axis < 3; axis++) {
+    while (node.qmin[axis] > 0 &&
+           dequantize_bbox(node, parent).min[axis] > bbox.min[axis])
+      node.qmin[axis] -= 1;
+    while (node.qmax[axis] < 255 &&
+           dequantize_bbox(node, parent).max[axis] < bbox.max[axis])
+      node.qmax[axis] += 1;
+  }
+}
+
+// Quantize a compact bvh. Each node is quantized in the decoded bounds of its
+// parent, as seen during traversal, with the root quantized in its own bounds.
+static void quantize_bvh(bvh_vector<bvh_quantized_node>& qnodes,
+    const bvh_vector<bvh_compact_node>& cnodes) {
+  // prepare to build nodes
+  qnodes.clear();
+  if (cnodes.empty() || cnodes[0].bbox.min.x > cnodes[0].bbox.max.x) return;
+  qnodes.resize(cnodes.size());
+
+  // stack of node ids with the decoded bounds of the parent
+  auto stack = std::vector<std::pair<int, bbox3f>>{{0, cnodes[0].bbox}};
+  while (!stack.empty()) {
+    auto [nodeid, parent] = stack.back();
+    stack.pop_back();
+    auto& cnode    = cnodes[nodeid];
+    auto& qnode    = qnodes[nodeid];
+    qnode.internal = cnode.internal;
+    qnode.axis     = cnode.axis;
+    qnode.start    = cnode.start;
+    qnode.num      = cnode.num;
+    if (cnode.bbox.min.x > cnode.bbox.max.x) {
+      // empty leaves decode to a point at the parent corner
+      continue;
+    }
+    quantize_bbox(qnode, cnode.bbox, parent);
+    if (cnode.internal) {
+      auto bbox = dequantize_bbox(qnode, parent);
+      stack.push_back({nodeid + 1, bbox});
+      stack.push_back({cnode.start, bbox});
+    }
+  }
+}
+
+// Build the nodes used for traversal according to the bvh layout
+static void init_bvh_layout(bvh_tree* bvh, const trace_params& params) {
+  bvh->nodes4.clear();
+  bvh->nodes8.clear();
+  bvh->cnodes.clear();
+  bvh->qnodes.clear();
+  switch (params.layout) {
+    case bvh_layout::binary: break;
+    case bvh_layout::wide4: collapse_bvh(bvh->nodes4, bvh->nodes); break;
+    case bvh_layout::wide8: collapse_bvh(bvh->nodes8, bvh->nodes); break;
+    case bvh_layout::compact: compact_bvh(bvh->cnodes, bvh->nodes); break;
+    case bvh_layout::quantized: {
+      auto cnodes = bvh_vector<bvh_compact_node>{};
+      compact_bvh(cnodes, bvh->nodes);
+      quantize_bvh(bvh->qnodes, cnodes);
+    } break;
+    default: throw std::runtime_error("should not have gotten here");
+  }
+}
+
+// Hash data with FNV-1a.
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  for (auto idx = (size_t)0; idx < size; idx++) {
+    hash = (hash ^ bytes[idx]) * 1099511628211ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_vector(uint64_t hash, const std::vector<T>& values) {
+  auto size = (uint64_t)values.size();
+  hash      = hash_bytes(hash, &size, sizeof(size));
+  return hash_bytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+// Version of the bvh cache files, to be changed with the bvh data.
+const auto bvh_cache_version = 4ull;
+
+// Hash of a shape bvh, computed from the shape content and the bvh settings.
+static uint64_t get_bvh_hash(
+    const ptr::shape* shape, const trace_params& params) {
+  auto hash     = hash_bytes(14695981039346656037ull, &bvh_cache_version,
+      sizeof(bvh_cache_version));
+  auto settings = vec4i{(int)params.bvh, (int)params.layout, params.triangles,
+      params.reorder};
+  hash          = hash_bytes(hash, &settings, sizeof(settings));
+  hash          = hash_vector(hash, shape->points);
+  hash          = hash_vector(hash, shape->lines);
+  hash          = hash_vector(hash, shape->triangles);
+  hash          = hash_vector(hash, shape->positions);
+  hash          = hash_vector(hash, shape->radius);
+  return hash;
+}
+
+// Arrays stored in a bvh, in the order they are cached.
+static auto get_bvh_arrays(bvh_tree* bvh) {
+  return std::tie(bvh->nodes, bvh->primitives, bvh->nodes4, bvh->nodes8,
+      bvh->cnodes, bvh->qnodes, bvh->triangles, bvh->lines);
+}
+
+// Number of arrays stored in a bvh. Change bvh_cache_version with it.
+const auto bvh_array_count =
+    std::tuple_size_v<decltype(get_bvh_arrays(nullptr))>;
+static_assert(bvh_array_count == 8, "update bvh_cache_version");
+
+// Call `func(array)` for all the arrays stored in a bvh.
+template <typename Func>
+static void visit_bvh_arrays(bvh_tree* bvh, Func&& func) {
+  std::apply([&](auto&... arrays) { (func(arrays), ...); },
+      get_bvh_arrays(bvh));
+}
+
+// Header of bvh cache files, followed by the bvh arrays.
+struct bvh_cache_header {
+  char     magic[8]               = {'y', 'o', 'c', 't', 'o', 'b', 'v', 'h'};
+  uint64_t hash                   = 0;
+  uint64_t sizes[bvh_array_count] = {};
+};
+
+// Get the filename of a cached bvh.
+static std::string get_bvh_cache_filename(
+    const std::string& dirname, uint64_t hash) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)hash);
+  return dirname + "/" + name;
+}
+
+// Map a file in memory and call `read(data, size)` on its content.
+template <typename Func>
+static bool map_file(const std::string& filename, Func&& read) {
+#ifndef _WIN32
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  auto size = (size_t)info.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  auto ok = read((const byte*)data, size);
+  munmap(data, size);
+  return ok;
+#else
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  auto buffer = std::vector<byte>{};
+  auto chunk  = std::vector<byte>(1 << 20);
+  while (auto num = fread(chunk.data(), 1, chunk.size(), fs))
+    buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + num);
+  fclose(fs);
+  return read(buffer.data(), buffer.size());
+#endif
+}
+
+// Load a shape bvh from the cache. Returns false if it is not present or
+// invalid, in which case the bvh is built.
+static bool load_bvh_cache(
+    const std::string& dirname, uint64_t hash, bvh_tree* bvh) {
+  return map_file(get_bvh_cache_filename(dirname, hash),
+      [hash, bvh](const byte* data, size_t size) {
+        // check header
+        auto header = bvh_cache_header{};
+        if (size < sizeof(header)) return false;
+        auto magic = header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, magic.magic, sizeof(magic.magic)) != 0 ||
+            header.hash != hash)
+          return false;
+
+        // check size
+        auto expected = sizeof(header), array = (size_t)0;
+        visit_bvh_arrays(bvh, [&](auto& values) {
+          expected += header.sizes[array++] * sizeof(values[0]);
+        });
+        if (size != expected) return false;
+
+        // copy arrays
+        auto offset = sizeof(header);
+        array       = 0;
+        visit_bvh_arrays(bvh, [&](auto& values) {
+          values.resize(header.sizes[array++]);
+          memcpy(
+              values.data(), data + offset, values.size() * sizeof(values[0]));
+          offset += values.size() * sizeof(values[0]);
+        });
+        return true;
+      });
+}
+
+// Save a shape bvh to the cache. The file is written under a temporary name
+// and renamed, so that concurrent runs never see partial files. Errors are
+// ignored since the cache is only an optimization.
+static void save_bvh_cache(
+    const std::string& dirname, uint64_t hash, bvh_tree* bvh) {
+  auto filename = get_bvh_cache_filename(dirname, hash);
+  auto tmpname  = filename + "." + std::to_string(std::random_device{}());
+  auto fs       = fopen(tmpname.c_str(), "wb");
+  if (!fs) return;
+  auto header = bvh_cache_header{};
+  header.hash = hash;
+  auto array  = 0;
+  visit_bvh_arrays(
+      bvh, [&](auto& values) { header.sizes[array++] = values.size(); });
+  auto ok = fwrite(&header, sizeof(header), 1, fs) == 1;
+  visit_bvh_arrays(bvh, [&](auto& values) {
+    if (values.empty()) return;
+    ok = ok && fwrite(values.data(), sizeof(values[0]), values.size(), fs) ==
+                   values.size();
+  });
+  ok = fclose(fs) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0)
+    std::remove(tmpname.c_str());
+}
+
+// Precompute triangles in the order of the bvh primitives.
+static void init_bvh_triangles(ptr::shape* shape) {
+  auto bvh = shape->bvh;
+  bvh->triangles.clear();
+  if (shape->triangles.empty()) return;
+  bvh->triangles.resize((bvh->primitives.size() + 3) / 4);
+  for (auto idx = 0; idx < bvh->primitives.size(); idx++) {
+    auto& t      = shape->triangles[bvh->primitives[idx]];
+    auto& packet = bvh->triangles[idx / 4];
+    auto  lane   = idx % 4;
+    auto  p0     = shape->positions[t.x];
+    auto  e1     = shape->positions[t.y] - p0;
+    auto  e2     = shape->positions[t.z] - p0;
+    for (auto axis = 0; axis < 3; axis++) {
+      packet.p0[axis][lane] = p0[axis];
+      packet.e1[axis][lane] = e1[axis];
+      packet.e2[axis][lane] = e2[axis];
+    }
+  }
+}
+
+// Precompute lines in the order of the bvh primitives.
+static void init_bvh_lines(ptr::shape* shape) {
+  auto bvh = shape->bvh;
+  bvh->lines.clear();
+  if (shape->lines.empty()) return;
+  bvh->lines.resize((bvh->primitives.size() + 3) / 4);
+  for (auto idx = 0; idx < bvh->primitives.size(); idx++) {
+    auto& l      = shape->lines[bvh->primitives[idx]];
+    auto& packet = bvh->lines[idx / 4];
+    auto  lane   = idx % 4;
+    auto  p0     = shape->positions[l.x];
+    auto  v      = shape->positions[l.y] - p0;
+    for (auto axis = 0; axis < 3; axis++) {
+      packet.p0[axis][lane] = p0[axis];
+      packet.v[axis][lane]  = v[axis];
+    }
+    packet.r0[lane] = shape->radius[l.x];
+    packet.r1[lane] = shape->radius[l.y];
+  }
+}
+
+// Primitive type of the leaves of a shape bvh.
+static bvh_leaf get_bvh_leaf(const ptr::shape* shape) {
+  auto bvh = shape->bvh;
+  if (!shape->points.empty()) return bvh_leaf::points;
+  if (!shape->lines.empty())
+    return bvh->lines.empty() ? bvh_leaf::lines : bvh_leaf::lines4;
+  if (!shape->triangles.empty())
+    return bvh->triangles.empty() ? bvh_leaf::triangles : bvh_leaf::triangles4;
+  return bvh_leaf::none;
+}
+
+static void init_bvh(
+    ptr::shape* shape, const trace_params& params, bool parallel) {
+  // load the bvh from the cache if present
+  auto hash = (uint64_t)0;
+  if (!params.bvh_cache.empty()) {
+    hash = get_bvh_hash(shape, params);
+    if (shape->bvh) delete shape->bvh;
+    shape->bvh = new bvh_tree{};
+    if (load_bvh_cache(params.bvh_cache, hash, shape->bvh)) {
+      shape->bvh->leaf = get_bvh_leaf(shape);
+      return;
+    }
+  }
+
+  // build primitives
+  auto primitives = std::vector<bvh_primitive>{};
+  if (!shape->points.empty()) {
+    for (auto idx = 0; idx < shape->points.size(); idx++) {
+      auto& p             = shape->points[idx];
+      auto& primitive     = primitives.emplace_back();
+      primitive.bbox      = point_bounds(shape->positions[p], shape->radius[p]);
+      primitive.center    = center(primitive.bbox);
+      primitive.primitive = idx;
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = 0; idx < shape->lines.size(); idx++) {
+      auto& l         = shape->lines[idx];
+      auto& primitive = primitives.emplace_back();
+      primitive.bbox = line_bounds(shape->positions[l.x], shape->positions[l.y],
+          shape->radius[l.x], shape->radius[l.y]);
+      primitive.center    = center(primitive.bbox);
+      primitive.primitive = idx;
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = 0; idx < shape->triangles.size(); idx++) {
+      auto& primitive = primitives.emplace_back();
+      auto& t         = shape->triangles[idx];
+      primitive.bbox  = triangle_bounds(
+          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+      primitive.center    = center(primitive.bbox);
+      primitive.primitive = idx;
+    }
+  }
+
+  // build nodes
+  if (shape->bvh) delete shape->bvh;
+  shape->bvh = new bvh_tree{};
+  if (params.bvh == bvh_type::sbvh) {
+    build_sbvh(shape->bvh->nodes, primitives, shape);
+  } else {
+    build_bvh(shape->bvh->nodes, primitives, params.bvh, parallel);
+  }
+  if (params.reorder) reorder_bvh(shape->bvh->nodes);
+  init_bvh_layout(shape->bvh, params);
+
+  // set bvh primitives
+  shape->bvh->primitives.reserve(primitives.size());
+  for (auto& primitive : primitives) {
+    shape->bvh->primitives.push_back(primitive.primitive);
+  }
+
+  // precompute triangles and lines in leaf order
+  if (params.triangles) init_bvh_triangles(shape);
+  if (params.triangles) init_bvh_lines(shape);
+  shape->bvh->leaf = get_bvh_leaf(shape);
+
+  // save the bvh to the cache
+  if (!params.bvh_cache.empty())
+    save_bvh_cache(params.bvh_cache, hash, shape->bvh);
+}
+
+// Number of primitives in a shape
+static int get_primitives(const ptr::shape* shape) {
+  if (!shape->points.empty()) return (int)shape->points.size();
+  if (!shape->lines.empty()) return (int)shape->lines.size();
+  return (int)shape->triangles.size();
+}
+
+// Whether a frame is rigid, with an orthonormal rotation.
+static bool is_rigid(const frame3f& frame) {
+  const auto epsilon = 1e-5f;
+  return abs(dot(frame.x, frame.x) - 1) < epsilon &&
+         abs(dot(frame.y, frame.y) - 1) < epsilon &&
+         abs(dot(frame.z, frame.z) - 1) < epsilon &&
+         abs(dot(frame.x, frame.y)) < epsilon &&
+         abs(dot(frame.x, frame.z)) < epsilon &&
+         abs(dot(frame.y, frame.z)) < epsilon;
+}
+
+// Build the scene bvh over the object bounds, and the object inverse frames.
+static void init_scene_bvh(ptr::scene* scene, const trace_params& params) {
+  // instance bboxes
+  auto primitives = std::vector<bvh_primitive>{};
+  auto object_id  = 0;
+  for (auto object : scene->objects) {
+    object->inv_frame = inverse(object->frame, !is_rigid(object->frame));
+    auto& primitive = primitives.emplace_back();
+    primitive.bbox =
+        object->shape->bvh->nodes.empty()
+            ? invalidb3f
+            : transform_bbox(object->frame, object->shape->bvh->nodes[0].bbox);
+    primitive.center    = center(primitive.bbox);
+    primitive.primitive = object_id++;
+  }
+
+  // build nodes
+  if (scene->bvh) delete scene->bvh;
+  scene->bvh = new bvh_tree{};
+  build_bvh(scene->bvh->nodes, primitives, params.bvh, !params.noparallel);
+  if (params.reorder) reorder_bvh(scene->bvh->nodes);
+  init_bvh_layout(scene->bvh, params);
+
+  // set bvh primitives
+  scene->bvh->primitives.reserve(primitives.size());
+  for (auto& primitive : primitives) {
+    scene->bvh->primitives.push_back(primitive.primitive);
+  }
+}
+
+void init_bvh(ptr::scene* scene, const trace_params& params,
+    progress_callback progress_cb) {
+  // handle progress
+  auto progress       = vec2i{0, 1 + (int)scene->shapes.size()};
+  auto progress_mutex = std::mutex{};
+
+  // threads
+  init_thread_pool(params);
+
+  // shapes
+  if (params.noparallel) {
+    for (auto idx = 0; idx < scene->shapes.size(); idx++) {
+      if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
+      init_bvh(scene->shapes[idx], params, false);
+    }
+  } else {
+    // large shapes are built one at a time with parallel splits, while
+    // small shapes are built in parallel with each other
+    auto large_shapes = std::vector<ptr::shape*>{};
+    auto small_shapes = std::vector<ptr::shape*>{};
+    for (auto shape : scene->shapes) {
+      if (get_primitives(shape) >= bvh_parallel_prims) {
+        large_shapes.push_back(shape);
+      } else {
+        small_shapes.push_back(shape);
+      }
+    }
+    for (auto shape : large_shapes) {
+      if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
+      init_bvh(shape, params, true);
+    }
+    parallel_for((int)small_shapes.size(),
+        [&small_shapes, &params, &progress, &progress_mutex, &progress_cb](
+            int idx) {
+          if (progress_cb) {
+            auto lock = std::lock_guard{progress_mutex};
+            progress_cb("build shape bvh", progress.x++, progress.y);
+          }
+          init_bvh(small_shapes[idx], params, false);
+        });
+  }
+
+  // handle progress
+  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
+
+  // scene
+  init_scene_bvh(scene, params);
+
+  // handle progress
+  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+}
+
+// Refit bvh nodes bottom-up from the bounds of the bvh primitives. Children
+// are always stored after their parents, so nodes are updated in reverse.
+static void update_bvh(bvh_tree* bvh, const std::vector<bbox3f>& bboxes) {
+  for (auto nodeid = (int)bvh->nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh->nodes[nodeid];
+    node.bbox  = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, bvh->nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        node.bbox = merge(node.bbox, bboxes[node.start + idx]);
+      }
+    }
+  }
+}
+
+static void update_bvh(ptr::shape* shape, const trace_params& params) {
+  // build primitives
+  auto bvh    = shape->bvh;
+  auto bboxes = std::vector<bbox3f>(bvh->primitives.size());
+  if (!shape->points.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& p     = shape->points[bvh->primitives[idx]];
+      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& l     = shape->lines[bvh->primitives[idx]];
+      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
+          shape->radius[l.x], shape->radius[l.y]);
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = 0; idx < bboxes.size(); idx++) {
+      auto& t     = shape->triangles[bvh->primitives[idx]];
+      bboxes[idx] = triangle_bounds(
+          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+    }
+  }
+
+  // update nodes
+  update_bvh(bvh, bboxes);
+  init_bvh_layout(bvh, params);
+  if (!bvh->triangles.empty()) init_bvh_triangles(shape);
+  if (!bvh->lines.empty()) init_bvh_lines(shape);
+}
+
+static void init_light_bvh(ptr::scene* scene);
+
+void update_bvh(ptr::scene* scene,
+    const std::vector<ptr::shape*>& updated_shapes,
+    const trace_params&             params) {
+  // refit shapes
+  if (params.noparallel) {
+    for (auto shape : updated_shapes) update_bvh(shape, params);
+  } else {
+    parallel_for((int)updated_shapes.size(), [&](int idx) {
+      update_bvh(updated_shapes[idx], params);
+    });
+  }
+
+  // rebuild the scene bvh, which is small and may change a lot
+  init_scene_bvh(scene, params);
+
+  // rebuild the light bvh, since emitters may have moved
+  if (scene->light_bvh) init_light_bvh(scene);
+}
+
+// Accumulate statistics for a bvh tree. Returns the tree SAH cost.
+static float get_bvh_stats(const bvh_tree* bvh, bvh_stats& stats) {
+  if (!bvh) return 0;
+  stats.memory += bvh->nodes.size() * sizeof(bvh_node) +
+                  bvh->primitives.size() * sizeof(int) +
+                  bvh->nodes4.size() * sizeof(bvh_node4) +
+                  bvh->nodes8.size() * sizeof(bvh_node8) +
+                  bvh->cnodes.size() * sizeof(bvh_compact_node) +
+                  bvh->qnodes.size() * sizeof(bvh_quantized_node) +
+                  bvh->triangles.size() * sizeof(bvh_triangle4) +
+                  bvh->lines.size() * sizeof(bvh_line4);
+  if (!bvh->nodes4.empty()) {
+    stats.node_memory += bvh->nodes4.size() * sizeof(bvh_node4);
+  } else if (!bvh->nodes8.empty()) {
+    stats.node_memory += bvh->nodes8.size() * sizeof(bvh_node8);
+  } else if (!bvh->cnodes.empty()) {
+    stats.node_memory += bvh->cnodes.size() * sizeof(bvh_compact_node);
+  } else if (!bvh->qnodes.empty()) {
+    stats.node_memory += bvh->qnodes.size() * sizeof(bvh_quantized_node);
+  } else {
+    stats.node_memory += bvh->nodes.size() * sizeof(bvh_node);
+  }
+  if (bvh->nodes.empty()) return 0;
+  auto root_area = max(bbox_area(bvh->nodes[0].bbox), 1e-12f);
+  auto cost      = 0.0f;
+  auto stack     = std::vector<vec2i>{{0, 1}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node = bvh->nodes[nodeid];
+    auto  prob = bbox_area(node.bbox) / root_area;
+    stats.nodes += 1;
+    stats.max_depth = max(stats.max_depth, depth);
+    if (node.internal) {
+      cost += prob * bvh_sah_traversal_cost;
+      stack.push_back({node.start + 0, depth + 1});
+      stack.push_back({node.start + 1, depth + 1});
+    } else {
+      cost += prob * node.num;
+      stats.leaves += 1;
+      stats.primitives += node.num;
+      stats.max_prims = max(stats.max_prims, (int)node.num);
+    }
+  }
+  return cost;
+}
+
+bvh_stats get_bvh_stats(const ptr::scene* scene) {
+  auto stats = bvh_stats{};
+  for (auto shape : scene->shapes) {
+    stats.shape_cost += get_bvh_stats(shape->bvh, stats);
+  }
+  stats.scene_cost = get_bvh_stats(scene->bvh, stats);
+  return stats;
+}
+
+// Intersect a ray with a packet of four precomputed triangles, with the same
+// test as intersect_triangle(). Returns the mask of the triangles that are
+// hit and sets their distances and uvs.
+static int intersect_triangle4(const bvh_triangle4& tri, const ray3f& ray,
+    float* dist, float* u_, float* v_) {
+#if defined(__SSE2__) || defined(_M_X64)
+  auto dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y),
+       dz = _mm_set1_ps(ray.d.z);
+  auto e1x = _mm_load_ps(tri.e1[0]), e1y = _mm_load_ps(tri.e1[1]),
+       e1z = _mm_load_ps(tri.e1[2]);
+  auto e2x = _mm_load_ps(tri.e2[0]), e2y = _mm_load_ps(tri.e2[1]),
+       e2z = _mm_load_ps(tri.e2[2]);
+  // pvec = cross(d, e2), det = dot(e1, pvec)
+  auto px  = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  auto py  = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  auto pz  = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  auto det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+      _mm_mul_ps(e1z, pz));
+  auto inv_det = _mm_div_ps(_mm_set1_ps(1), det);
+  // tvec = o - p0, u = dot(tvec, pvec) / det
+  auto tx = _mm_sub_ps(_mm_set1_ps(ray.o.x), _mm_load_ps(tri.p0[0]));
+  auto ty = _mm_sub_ps(_mm_set1_ps(ray.o.y), _mm_load_ps(tri.p0[1]));
+  auto tz = _mm_sub_ps(_mm_set1_ps(ray.o.z), _mm_load_ps(tri.p0[2]));
+  auto u  = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+          _mm_mul_ps(tz, pz)),
+      inv_det);
+  // qvec = cross(tvec, e1), v = dot(d, qvec) / det, t = dot(e2, qvec) / det
+  auto qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+  auto qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+  auto qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+  auto v  = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+          _mm_mul_ps(dz, qz)),
+      inv_det);
+  auto t = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+          _mm_mul_ps(e2z, qz)),
+      inv_det);
+  // check all conditions at once
+  auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  auto hit  = _mm_and_ps(
+      _mm_and_ps(_mm_cmpneq_ps(det, zero),
+          _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one))),
+      _mm_and_ps(
+          _mm_and_ps(
+              _mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)),
+          _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(ray.tmin)),
+              _mm_cmple_ps(t, _mm_set1_ps(ray.tmax)))));
+  _mm_storeu_ps(dist, t);
+  _mm_storeu_ps(u_, u);
+  _mm_storeu_ps(v_, v);
+  return _mm_movemask_ps(hit);
+#else
+  auto mask = 0;
+  for (auto lane = 0; lane < 4; lane++) {
+    auto edge1   = vec3f{tri.e1[0][lane], tri.e1[1][lane], tri.e1[2][lane]};
+    auto edge2   = vec3f{tri.e2[0][lane], tri.e2[1][lane], tri.e2[2][lane]};
+    auto p0      = vec3f{tri.p0[0][lane], tri.p0[1][lane], tri.p0[2][lane]};
+    auto pvec    = cross(ray.d, edge2);
+    auto det     = dot(edge1, pvec);
+    auto inv_det = 1.0f / det;
+    auto tvec    = ray.o - p0;
+    auto qvec    = cross(tvec, edge1);
+    u_[lane]     = dot(tvec, pvec) * inv_det;
+    v_[lane]     = dot(ray.d, qvec) * inv_det;
+    dist[lane]   = dot(edge2, qvec) * inv_det;
+    if (det != 0 && u_[lane] >= 0 && u_[lane] <= 1 && v_[lane] >= 0 &&
+        u_[lane] + v_[lane] <= 1 && dist[lane] >= ray.tmin &&
+        dist[lane] <= ray.tmax)
+      mask |= 1 << lane;
+  }
+  return mask;
+#endif
+}
+
+#if defined(__AVX__)
+// Intersect a ray with two consecutive packets of precomputed triangles at
+// once, as in intersect_triangle4().
+static int intersect_triangle8(const bvh_triangle4* tri, const ray3f& ray,
+    float* dist, float* u_, float* v_) {
+  auto load = [](const float* lo, const float* hi) {
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_load_ps(lo)), _mm_load_ps(hi), 1);
+  };
+  auto dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y),
+       dz = _mm256_set1_ps(ray.d.z);
+  auto e1x = load(tri[0].e1[0], tri[1].e1[0]),
+       e1y = load(tri[0].e1[1], tri[1].e1[1]),
+       e1z = load(tri[0].e1[2], tri[1].e1[2]);
+  auto e2x = load(tri[0].e2[0], tri[1].e2[0]),
+       e2y = load(tri[0].e2[1], tri[1].e2[1]),
+       e2z = load(tri[0].e2[2], tri[1].e2[2]);
+  // pvec = cross(d, e2), det = dot(e1, pvec)
+  auto px  = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+  auto py  = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+  auto pz  = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+  auto det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+      _mm256_mul_ps(e1z, pz));
+  auto inv_det = _mm256_div_ps(_mm256_set1_ps(1), det);
+  // tvec = o - p0, u = dot(tvec, pvec) / det
+  auto tx = _mm256_sub_ps(
+      _mm256_set1_ps(ray.o.x), load(tri[0].p0[0], tri[1].p0[0]));
+  auto ty = _mm256_sub_ps(
+      _mm256_set1_ps(ray.o.y), load(tri[0].p0[1], tri[1].p0[1]));
+  auto tz = _mm256_sub_ps(
+      _mm256_set1_ps(ray.o.z), load(tri[0].p0[2], tri[1].p0[2]));
+  auto u  = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+          _mm256_mul_ps(tz, pz)),
+      inv_det);
+  // qvec = cross(tvec, e1), v = dot(d, qvec) / det, t = dot(e2, qvec) / det
+  auto qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+  auto qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+  auto qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+  auto v  = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+          _mm256_mul_ps(dz, qz)),
+      inv_det);
+  auto t = _mm256_mul_ps(
+      _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+          _mm256_mul_ps(e2z, qz)),
+      inv_det);
+  // check all conditions at once
+  auto zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+  auto hit  = _mm256_and_ps(
+      _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_UQ),
+          _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ),
+              _mm256_cmp_ps(u, one, _CMP_LE_OQ))),
+      _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                        _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)),
+          _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(ray.tmin), _CMP_GE_OQ),
+              _mm256_cmp_ps(t, _mm256_set1_ps(ray.tmax), _CMP_LE_OQ))));
+  _mm256_storeu_ps(dist, t);
+  _mm256_storeu_ps(u_, u);
+  _mm256_storeu_ps(v_, v);
+  return _mm256_movemask_ps(hit);
+}
+#endif
+
+// Intersect a ray with the precomputed triangles of a bvh leaf, updating the
+// ray tmax. Packets are tested whole, masking lanes outside the leaf.
+static bool intersect_leaf_triangles(const bvh_tree* bvh, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance) {
+  auto  hit = false;
+  auto  end = start + num;
+  float dist[8], u[8], v[8];
+  for (auto packet = start / 4; packet * 4 < end;) {
+    auto lanes = 4, mask = 0;
+#if defined(__AVX__)
+    if ((packet + 1) * 4 < end) {
+      lanes = 8;
+      mask  = intersect_triangle8(&bvh->triangles[packet], ray, dist, u, v);
+    } else {
+      mask = intersect_triangle4(bvh->triangles[packet], ray, dist, u, v);
+    }
+#else
+    mask = intersect_triangle4(bvh->triangles[packet], ray, dist, u, v);
+#endif
+    for (auto lane = 0; lane < lanes; lane++) {
+      auto idx = packet * 4 + lane;
+      if (!(mask & (1 << lane)) || idx < start || idx >= end) continue;
+      if (dist[lane] > ray.tmax) continue;
+      hit      = true;
+      element  = bvh->primitives[idx];
+      uv       = {u[lane], v[lane]};
+      distance = dist[lane];
+      ray.tmax = distance;
+    }
+    packet += lanes / 4;
+  }
+  return hit;
+}
+
+// Intersect a ray with a packet of four precomputed lines, with the same
+// test as intersect_line(), that treats lines as capsules with radii varying
+// along the segment. Returns the mask of the lines that are hit and sets
+// their distances and uvs.
+static int intersect_line4(const bvh_line4& line, const ray3f& ray,
+    float* dist, float* u_, float* v_) {
+#if defined(__SSE2__) || defined(_M_X64)
+  auto dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y),
+       dz = _mm_set1_ps(ray.d.z);
+  auto vx = _mm_load_ps(line.v[0]), vy = _mm_load_ps(line.v[1]),
+       vz = _mm_load_ps(line.v[2]);
+  auto p0x = _mm_load_ps(line.p0[0]), p0y = _mm_load_ps(line.p0[1]),
+       p0z = _mm_load_ps(line.p0[2]);
+  auto dot3 = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by,
+                  __m128 bz) {
+    return _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+  };
+  // w = o - p0, then solve for the closest points of the ray and segment
+  auto wx  = _mm_sub_ps(_mm_set1_ps(ray.o.x), p0x);
+  auto wy  = _mm_sub_ps(_mm_set1_ps(ray.o.y), p0y);
+  auto wz  = _mm_sub_ps(_mm_set1_ps(ray.o.z), p0z);
+  auto a   = _mm_set1_ps(dot(ray.d, ray.d));
+  auto b   = dot3(dx, dy, dz, vx, vy, vz);
+  auto c   = dot3(vx, vy, vz, vx, vy, vz);
+  auto d   = dot3(dx, dy, dz, wx, wy, wz);
+  auto e   = dot3(vx, vy, vz, wx, wy, wz);
+  auto det = _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b));
+  auto t = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(b, e), _mm_mul_ps(c, d)), det);
+  auto s = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(a, e), _mm_mul_ps(b, d)), det);
+  auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  s         = _mm_min_ps(_mm_max_ps(s, zero), one);
+  // distance of the closest points, compared to the radius at s
+  auto px = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.x), _mm_mul_ps(dx, t)),
+      _mm_add_ps(p0x, _mm_mul_ps(vx, s)));
+  auto py = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.y), _mm_mul_ps(dy, t)),
+      _mm_add_ps(p0y, _mm_mul_ps(vy, s)));
+  auto pz = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(ray.o.z), _mm_mul_ps(dz, t)),
+      _mm_add_ps(p0z, _mm_mul_ps(vz, s)));
+  auto d2 = dot3(px, py, pz, px, py, pz);
+  auto r  = _mm_add_ps(_mm_mul_ps(_mm_load_ps(line.r0), _mm_sub_ps(one, s)),
+      _mm_mul_ps(_mm_load_ps(line.r1), s));
+  // check all conditions at once
+  auto hit = _mm_and_ps(
+      _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmple_ps(d2, _mm_mul_ps(r, r))),
+      _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(ray.tmin)),
+          _mm_cmple_ps(t, _mm_set1_ps(ray.tmax))));
+  _mm_storeu_ps(dist, t);
+  _mm_storeu_ps(u_, s);
+  _mm_storeu_ps(v_, _mm_div_ps(_mm_sqrt_ps(d2), r));
+  return _mm_movemask_ps(hit);
+#else
+  auto mask = 0;
+  for (auto lane = 0; lane < 4; lane++) {
+    auto p0 = vec3f{line.p0[0][lane], line.p0[1][lane], line.p0[2][lane]};
+    auto v  = vec3f{line.v[0][lane], line.v[1][lane], line.v[2][lane]};
+    auto uv = zero2f;
+    if (intersect_line(ray, p0, p0 + v, line.r0[lane], line.r1[lane], uv,
+            dist[lane]))
+      mask |= 1 << lane;
+    u_[lane] = uv.x;
+    v_[lane] = uv.y;
+  }
+  return mask;
+#endif
+}
+
+// Intersect a ray with the precomputed lines of a bvh leaf, updating the
+// ray tmax. Packets are tested whole, masking lanes outside the leaf.
+static bool intersect_leaf_lines(const bvh_tree* bvh, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance) {
+  auto  hit = false;
+  auto  end = start + num;
+  float dist[4], u[4], v[4];
+  for (auto packet = start / 4; packet * 4 < end; packet++) {
+    auto mask = intersect_line4(bvh->lines[packet], ray, dist, u, v);
+    for (auto lane = 0; lane < 4; lane++) {
+      auto idx = packet * 4 + lane;
+      if (!(mask & (1 << lane)) || idx < start || idx >= end) continue;
+      if (dist[lane] > ray.tmax) continue;
+      hit      = true;
+      element  = bvh->primitives[idx];
+      uv       = {u[lane], v[lane]};
+      distance = dist[lane];
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
+// Calls `func(leaf)` with the leaf type of a bvh as a compile-time constant,
+// so that traversals are specialized for each primitive type and leaves are
+// intersected without checking the shape type.
+template <typename Func>
+static auto visit_bvh_leaf(bvh_leaf leaf, Func&& func) {
+  using std::integral_constant;
+  switch (leaf) {
+    case bvh_leaf::points:
+      return func(integral_constant<bvh_leaf, bvh_leaf::points>{});
+    case bvh_leaf::lines:
+      return func(integral_constant<bvh_leaf, bvh_leaf::lines>{});
+    case bvh_leaf::lines4:
+      return func(integral_constant<bvh_leaf, bvh_leaf::lines4>{});
+    case bvh_leaf::triangles:
+      return func(integral_constant<bvh_leaf, bvh_leaf::triangles>{});
+    case bvh_leaf::triangles4:
+      return func(integral_constant<bvh_leaf, bvh_leaf::triangles4>{});
+    default: return func(integral_constant<bvh_leaf, bvh_leaf::none>{});
+  }
+}
+
+// Intersect a ray with the primitives of a bvh leaf, updating the ray tmax.
+template <bvh_leaf Leaf>
+static bool intersect_shape_leaf(const ptr::shape* shape, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance) {
+  auto hit = false;
+  if constexpr (Leaf == bvh_leaf::points) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[shape->bvh->primitives[idx]];
+      if (intersect_point(
+              ray, shape->positions[p], shape->radius[p], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh->primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if constexpr (Leaf == bvh_leaf::lines) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[shape->bvh->primitives[idx]];
+      if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+              shape->radius[l.x], shape->radius[l.y], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh->primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if constexpr (Leaf == bvh_leaf::lines4) {
+    hit = intersect_leaf_lines(
+        shape->bvh, start, num, ray, element, uv, distance);
+  } else if constexpr (Leaf == bvh_leaf::triangles4) {
+    hit = intersect_leaf_triangles(
+        shape->bvh, start, num, ray, element, uv, distance);
+  } else if constexpr (Leaf == bvh_leaf::triangles) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[shape->bvh->primitives[idx]];
+      if (intersect_triangle(ray, shape->positions[t.x], shape->positions[t.y],
+              shape->positions[t.z], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh->primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  }
+  return hit;
+}
+
+// Intersect a ray with the N children bounds of a wide node. Returns the
+// mask of the children that are hit and sets their entry distances. Bounds
+// are selected by the ray direction signs, so empty bounds are never hit.
+template <int N>
+static int intersect_wide_bbox(const bvh_wide_node<N>& node, const ray3f& ray,
+    const vec3f& ray_dinv, const vec3i& ray_dsign, float* tnear) {
+  // near and far planes
+  auto nx = ray_dsign.x ? 3 : 0, ny = ray_dsign.y ? 4 : 1,
+       nz = ray_dsign.z ? 5 : 2;
+  auto fx = ray_dsign.x ? 0 : 3, fy = ray_dsign.y ? 1 : 4,
+       fz = ray_dsign.z ? 2 : 5;
+#if defined(__AVX__)
+  if constexpr (N == 8) {
+    auto ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y),
+         oz = _mm256_set1_ps(ray.o.z);
+    auto dx = _mm256_set1_ps(ray_dinv.x), dy = _mm256_set1_ps(ray_dinv.y),
+         dz = _mm256_set1_ps(ray_dinv.z);
+    auto t0 = _mm256_max_ps(
+        _mm256_max_ps(
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bbox[nx]), ox), dx),
+            _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_load_ps(node.bbox[ny]), oy), dy)),
+        _mm256_max_ps(
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bbox[nz]), oz), dz),
+            _mm256_set1_ps(ray.tmin)));
+    auto t1 = _mm256_min_ps(
+        _mm256_min_ps(
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bbox[fx]), ox), dx),
+            _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_load_ps(node.bbox[fy]), oy), dy)),
+        _mm256_min_ps(
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bbox[fz]), oz), dz),
+            _mm256_set1_ps(ray.tmax)));
+    t1 = _mm256_mul_ps(t1, _mm256_set1_ps(1.00000024f));
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  auto ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y),
+       oz = _mm_set1_ps(ray.o.z);
+  auto dx = _mm_set1_ps(ray_dinv.x), dy = _mm_set1_ps(ray_dinv.y),
+       dz = _mm_set1_ps(ray_dinv.z);
+  auto mask = 0;
+  for (auto lane = 0; lane < N; lane += 4) {
+    auto t0 = _mm_max_ps(
+        _mm_max_ps(
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[nx] + lane), ox), dx),
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[ny] + lane), oy), dy)),
+        _mm_max_ps(
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[nz] + lane), oz), dz),
+            _mm_set1_ps(ray.tmin)));
+    auto t1 = _mm_min_ps(
+        _mm_min_ps(
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[fx] + lane), ox), dx),
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[fy] + lane), oy), dy)),
+        _mm_min_ps(
+            _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bbox[fz] + lane), oz), dz),
+            _mm_set1_ps(ray.tmax)));
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+    _mm_storeu_ps(tnear + lane, t0);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << lane;
+  }
+  return mask;
+#else
+  auto mask = 0;
+  for (auto idx = 0; idx < N; idx++) {
+    auto t0 = max(max((node.bbox[nx][idx] - ray.o.x) * ray_dinv.x,
+                      (node.bbox[ny][idx] - ray.o.y) * ray_dinv.y),
+        max((node.bbox[nz][idx] - ray.o.z) * ray_dinv.z, ray.tmin));
+    auto t1 = min(min((node.bbox[fx][idx] - ray.o.x) * ray_dinv.x,
+                      (node.bbox[fy][idx] - ray.o.y) * ray_dinv.y),
+        min((node.bbox[fz][idx] - ray.o.z) * ray_dinv.z, ray.tmax));
+    t1 *= 1.00000024f;
+    tnear[idx] = t0;
+    if (t0 <= t1) mask |= 1 << idx;
+  }
+  return mask;
+#endif
+}
+
+// Maximum number of entries in the traversal stack of wide bvhs. Each wide
+// level opens at least one binary level, and leaves at most N - 1 siblings
+// on the stack when descending.
+template <int N>
+constexpr int bvh_wide_stack = (N - 1) * bvh_max_tree_depth + N;
+
+// Intersect ray with a wide bvh, calling `intersect_leaf(start, num, ray)`
+// for the leaves. The leaf function returns whether it hit a primitive and
+// updates the ray tmax. Children are visited from near to far.
+template <int N, typename Func>
+static bool intersect_wide_bvh(const bvh_vector<bvh_wide_node<N>>& nodes,
+    const ray3f& ray_, bool find_any, Func&& intersect_leaf) {
+  // check empty
+  if (nodes.empty()) return false;
+
+  // node stack, with children referenced as node * N + child, and their
+  // entry distances
+  int   node_stack[bvh_wide_stack<N>];
+  float dist_stack[bvh_wide_stack<N>];
+  auto  node_cur = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // push the children of a node that are hit, from far to near
+  auto push_children = [&](int nodeid) {
+    float tnear[N];
+    auto  mask = intersect_wide_bbox(
+        nodes[nodeid], ray, ray_dinv, ray_dsign, tnear);
+    int  children[N];
+    auto nchildren = 0;
+    for (auto idx = 0; idx < N; idx++) {
+      if (!(mask & (1 << idx))) continue;
+      auto pos = nchildren++;
+      while (pos > 0 && tnear[children[pos - 1]] < tnear[idx]) {
+        children[pos] = children[pos - 1];
+        pos--;
+      }
+      children[pos] = idx;
+    }
+    for (auto idx = 0; idx < nchildren; idx++) {
+      node_stack[node_cur] = nodeid * N + children[idx];
+      dist_stack[node_cur] = tnear[children[idx]];
+      node_cur++;
+    }
+  };
+
+  // walking stack
+  push_children(0);
+  while (node_cur) {
+    // grab child, skipping it if farther than the closest hit
+    node_cur--;
+    if (dist_stack[node_cur] > ray.tmax) continue;
+    auto& node  = nodes[node_stack[node_cur] / N];
+    auto  child = node_stack[node_cur] % N;
+
+    // visit internal nodes or intersect leaves
+    if (!node.num[child]) {
+      push_children(node.start[child]);
+    } else if (intersect_leaf(node.start[child], node.num[child], ray)) {
+      hit = true;
+      if (find_any) return hit;
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with a compact or quantized bvh, calling
+// `intersect_leaf(start, num, ray)` for the leaves. Quantized bounds are
+// decoded from the parent bounds kept in the stack, starting from `bbox`.
+template <typename Node, typename Func>
+static bool intersect_compact_bvh(const bvh_vector<Node>& nodes,
+    const bbox3f& bbox, const ray3f& ray_, bool find_any,
+    Func&& intersect_leaf) {
+  // check empty
+  if (nodes.empty()) return false;
+
+  // node stack, with parent bounds for quantized nodes
+  constexpr auto quantized = std::is_same_v<Node, bvh_quantized_node>;
+  int            node_stack[bvh_binary_stack];
+  bbox3f         bbox_stack[quantized ? bvh_binary_stack : 1];
+  auto           node_cur = 0;
+  node_stack[node_cur]    = 0;
+  bbox_stack[0]           = bbox;
+  node_cur++;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
   auto ray = ray_;
 
   // prepare ray for fast queries
@@ -696,54 +2634,30 @@ static bool intersect_shape_bvh(ptr::shape* shape, const ray3f& ray_,
   // walking stack
   while (node_cur) {
     // grab node
-    auto& node = bvh->nodes[node_stack[--node_cur]];
+    auto  nodeid = node_stack[--node_cur];
+    auto& node   = nodes[nodeid];
 
     // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    auto node_bbox = bbox3f{};
+    if constexpr (quantized) {
+      node_bbox = dequantize_bbox(node, bbox_stack[node_cur]);
+    } else {
+      node_bbox = node.bbox;
+    }
+    if (!intersect_bbox(ray, ray_dinv, node_bbox)) continue;
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
+    // intersect node, with the left child following its parent
     if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
-    } else if (!shape->points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape->points[shape->bvh->primitives[idx]];
-        if (intersect_point(
-                ray, shape->positions[p], shape->radius[p], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape->lines[shape->bvh->primitives[idx]];
-        if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
-                shape->radius[l.x], shape->radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape->triangles[shape->bvh->primitives[idx]];
-        if (intersect_triangle(ray, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+      auto first = nodeid + 1, second = node.start;
+      if (!ray_dsign[node.axis]) std::swap(first, second);
+      node_stack[node_cur] = first;
+      if constexpr (quantized) bbox_stack[node_cur] = node_bbox;
+      node_cur++;
+      node_stack[node_cur] = second;
+      if constexpr (quantized) bbox_stack[node_cur] = node_bbox;
+      node_cur++;
+    } else if (intersect_leaf(node.start, (int)node.num, ray)) {
+      hit = true;
     }
 
     // check for early exit
@@ -753,31 +2667,229 @@ static bool intersect_shape_bvh(ptr::shape* shape, const ray3f& ray_,
   return hit;
 }
 
+// Intersect a ray with a bounding box as intersect_bbox(), also returning
+// the distance at which the ray enters the box.
+static bool intersect_bbox(const ray3f& ray, const vec3f& ray_dinv,
+    const bbox3f& bbox, float& tnear) {
+  auto it_min = (bbox.min - ray.o) * ray_dinv;
+  auto it_max = (bbox.max - ray.o) * ray_dinv;
+  auto tmin   = min(it_min, it_max);
+  auto tmax   = max(it_min, it_max);
+  auto t0     = max(max(tmin), ray.tmin);
+  auto t1     = min(min(tmax), ray.tmax);
+  t1 *= 1.00000024f;  // for double: 1.0000000000000004
+  tnear = t0;
+  return t0 <= t1;
+}
+
+// Intersect ray with a binary bvh, calling `intersect_leaf(start, num, ray)`
+// for the leaves. Both children are tested at their parent. The traversal
+// descends into the nearer child and pushes the farther one only when both
+// are hit, so the stack holds at most one node per tree level.
+template <typename Func>
+static bool intersect_binary_bvh(const bvh_tree* bvh, const ray3f& ray_,
+    bool find_any, Func&& intersect_leaf) {
+  // check empty
+  if (bvh->nodes.empty()) return false;
+
+  // node stack, with the entry distances of the nodes
+  int   node_stack[bvh_binary_stack];
+  float dist_stack[bvh_binary_stack];
+  auto  node_cur = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // start from the root if hit
+  auto tnear = 0.0f;
+  if (!intersect_bbox(ray, ray_dinv, bvh->nodes[0].bbox, tnear)) return false;
+  auto nodeid = 0;
+
+  // walking stack
+  while (nodeid >= 0) {
+    // visit internal nodes or intersect leaves
+    auto& node = bvh->nodes[nodeid];
+    nodeid     = -1;
+    if (node.internal) {
+      float tleft, tright;
+      auto  hit_left = intersect_bbox(
+          ray, ray_dinv, bvh->nodes[node.start + 0].bbox, tleft);
+      auto hit_right = intersect_bbox(
+          ray, ray_dinv, bvh->nodes[node.start + 1].bbox, tright);
+      if (hit_left && hit_right) {
+        auto near            = tleft <= tright ? 0 : 1;
+        node_stack[node_cur] = node.start + 1 - near;
+        dist_stack[node_cur] = max(tleft, tright);
+        node_cur++;
+        nodeid = node.start + near;
+      } else if (hit_left || hit_right) {
+        nodeid = node.start + (hit_left ? 0 : 1);
+      }
+    } else if (intersect_leaf(node.start, node.num, ray)) {
+      hit = true;
+      if (find_any) return hit;
+    }
+
+    // grab the next node, skipping the ones farther than the closest hit
+    while (nodeid < 0 && node_cur) {
+      node_cur--;
+      if (dist_stack[node_cur] <= ray.tmax) nodeid = node_stack[node_cur];
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with a bvh->
+template <bvh_leaf Leaf>
+static bool intersect_shape_bvh(ptr::shape* shape, const ray3f& ray_,
+    int& element, vec2f& uv, float& distance, bool find_any) {
+  // get bvh and shape pointers for fast access
+  auto bvh = shape->bvh;
+
+  // use wide or compact bvhs if present
+  auto intersect_leaf = [shape, &element, &uv, &distance](
+                            int start, int num, ray3f& ray) {
+    return intersect_shape_leaf<Leaf>(
+        shape, start, num, ray, element, uv, distance);
+  };
+  if (!bvh->nodes8.empty())
+    return intersect_wide_bvh(bvh->nodes8, ray_, find_any, intersect_leaf);
+  if (!bvh->nodes4.empty())
+    return intersect_wide_bvh(bvh->nodes4, ray_, find_any, intersect_leaf);
+  if (!bvh->cnodes.empty())
+    return intersect_compact_bvh(
+        bvh->cnodes, {}, ray_, find_any, intersect_leaf);
+  if (!bvh->qnodes.empty())
+    return intersect_compact_bvh(
+        bvh->qnodes, bvh->nodes[0].bbox, ray_, find_any, intersect_leaf);
+
+  return intersect_binary_bvh(bvh, ray_, find_any, intersect_leaf);
+}
+
+// Intersect ray with a bvh, with the traversal specialized for the type of
+// the shape primitives.
+static bool intersect_shape_bvh(ptr::shape* shape, const ray3f& ray,
+    int& element, vec2f& uv, float& distance, bool find_any) {
+  return visit_bvh_leaf(shape->bvh->leaf, [&](auto leaf) {
+    return intersect_shape_bvh<decltype(leaf)::value>(
+        shape, ray, element, uv, distance, find_any);
+  });
+}
+
+// Intersect a ray with the objects of a bvh leaf, updating the ray tmax.
+static bool intersect_scene_leaf(const ptr::scene* scene, int start, int num,
+    ray3f& ray, int& object, int& element, vec2f& uv, float& distance,
+    bool find_any) {
+  auto hit = false;
+  for (auto idx = start; idx < start + num; idx++) {
+    auto object_ = scene->objects[scene->bvh->primitives[idx]];
+    auto inv_ray = transform_ray(object_->inv_frame, ray);
+    if (intersect_shape_bvh(
+            object_->shape, inv_ray, element, uv, distance, find_any)) {
+      hit      = true;
+      object   = scene->bvh->primitives[idx];
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
 // Intersect ray with a bvh->
 static bool intersect_scene_bvh(const ptr::scene* scene, const ray3f& ray_,
-    int& object, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
+    int& object, int& element, vec2f& uv, float& distance, bool find_any) {
   // get bvh and scene pointers for fast access
   auto bvh = scene->bvh;
 
+  // use wide or compact bvhs if present
+  auto intersect_leaf = [&](int start, int num, ray3f& ray) {
+    return intersect_scene_leaf(scene, start, num, ray, object, element, uv,
+        distance, find_any);
+  };
+  if (!bvh->nodes8.empty())
+    return intersect_wide_bvh(bvh->nodes8, ray_, find_any, intersect_leaf);
+  if (!bvh->nodes4.empty())
+    return intersect_wide_bvh(bvh->nodes4, ray_, find_any, intersect_leaf);
+  if (!bvh->cnodes.empty())
+    return intersect_compact_bvh(
+        bvh->cnodes, {}, ray_, find_any, intersect_leaf);
+  if (!bvh->qnodes.empty())
+    return intersect_compact_bvh(
+        bvh->qnodes, bvh->nodes[0].bbox, ray_, find_any, intersect_leaf);
+
+  return intersect_binary_bvh(bvh, ray_, find_any, intersect_leaf);
+}
+
+// Check whether a ray hits any primitive of a bvh leaf.
+template <bvh_leaf Leaf>
+static bool occluded_shape_leaf(
+    const ptr::shape* shape, int start, int num, const ray3f& ray) {
+  auto bvh      = shape->bvh;
+  auto uv       = zero2f;
+  auto distance = 0.0f;
+  if constexpr (Leaf == bvh_leaf::points) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[bvh->primitives[idx]];
+      if (intersect_point(
+              ray, shape->positions[p], shape->radius[p], uv, distance))
+        return true;
+    }
+  } else if constexpr (Leaf == bvh_leaf::lines) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[bvh->primitives[idx]];
+      if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+              shape->radius[l.x], shape->radius[l.y], uv, distance))
+        return true;
+    }
+  } else if constexpr (Leaf == bvh_leaf::lines4 ||
+                       Leaf == bvh_leaf::triangles4) {
+    float dist[4], u[4], v[4];
+    for (auto packet = start / 4; packet * 4 < start + num; packet++) {
+      auto mask = 0;
+      if constexpr (Leaf == bvh_leaf::lines4) {
+        mask = intersect_line4(bvh->lines[packet], ray, dist, u, v);
+      } else {
+        mask = intersect_triangle4(bvh->triangles[packet], ray, dist, u, v);
+      }
+      for (auto lane = 0; lane < 4; lane++) {
+        auto idx = packet * 4 + lane;
+        if ((mask & (1 << lane)) && idx >= start && idx < start + num)
+          return true;
+      }
+    }
+  } else if constexpr (Leaf == bvh_leaf::triangles) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[bvh->primitives[idx]];
+      if (intersect_triangle(ray, shape->positions[t.x], shape->positions[t.y],
+              shape->positions[t.z], uv, distance))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Check whether a ray hits any primitive or object of a bvh, calling
+// `occluded_leaf(start, num)` for the leaves. The larger child is visited
+// first, since it is the most likely to contain an occluder.
+template <typename Func>
+static bool occluded_bvh(
+    const bvh_tree* bvh, const ray3f& ray, Func&& occluded_leaf) {
   // check empty
   if (bvh->nodes.empty()) return false;
 
   // node stack
-  int  node_stack[128];
+  int  node_stack[bvh_binary_stack];
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // shared variables
-  auto hit = false;
-
-  // copy ray to modify it
-  auto ray = ray_;
-
   // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
 
   // walking stack
   while (node_cur) {
@@ -785,67 +2897,396 @@ static bool intersect_scene_bvh(const ptr::scene* scene, const ray3f& ray_,
     auto& node = bvh->nodes[node_stack[--node_cur]];
 
     // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
     if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
 
+    // visit internal nodes, or stop at the first occluder
+    if (node.internal) {
+      auto left = node.start + 0, right = node.start + 1;
+      if (bbox_area(bvh->nodes[left].bbox) > bbox_area(bvh->nodes[right].bbox))
+        std::swap(left, right);
+      node_stack[node_cur++] = left;
+      node_stack[node_cur++] = right;
+    } else if (occluded_leaf(node.start, node.num)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool occluded(const ptr::scene* scene, const ray3f& ray_, float tmax) {
+  auto ray = ray3f{ray_.o, ray_.d, ray_.tmin, tmax};
+  return occluded_bvh(scene->bvh, ray, [&](int start, int num) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto object  = scene->objects[scene->bvh->primitives[idx]];
+      auto inv_ray = transform_ray(object->inv_frame, ray);
+      auto shape   = object->shape;
+      auto hit     = visit_bvh_leaf(shape->bvh->leaf, [&](auto leaf) {
+        return occluded_bvh(shape->bvh, inv_ray, [&](int start, int num) {
+          return occluded_shape_leaf<decltype(leaf)::value>(
+              shape, start, num, inv_ray);
+        });
+      });
+      if (hit) return true;
+    }
+    return false;
+  });
+}
+
+// Rays of a packet in SoA form, for SIMD bounding box tests.
+template <int N>
+struct bvh_packet_rays {
+  alignas(16) float o[3][N];
+  alignas(16) float dinv[3][N];
+  alignas(16) float tmin[N];
+  alignas(16) float tmax[N];
+};
+
+// Intersect the active rays of a packet with a bounding box, as in
+// intersect_bbox(). Returns the mask of the rays that hit the box.
+template <int N>
+static uint32_t intersect_packet_bbox(
+    const bbox3f& bbox, const bvh_packet_rays<N>& rays, uint32_t active) {
+  auto mask = 0u;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (auto lane = 0; lane < N; lane += 4) {
+    if (!((active >> lane) & 0xf)) continue;
+    auto t0 = _mm_load_ps(rays.tmin + lane), t1 = _mm_load_ps(rays.tmax + lane);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto o    = _mm_load_ps(rays.o[axis] + lane);
+      auto dinv = _mm_load_ps(rays.dinv[axis] + lane);
+      auto a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bbox.min[axis]), o), dinv);
+      auto b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bbox.max[axis]), o), dinv);
+      t0     = _mm_max_ps(t0, _mm_min_ps(a, b));
+      t1     = _mm_min_ps(t1, _mm_max_ps(a, b));
+    }
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+    mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << lane;
+  }
+#else
+  for (auto lane = 0; lane < N; lane++) {
+    if (!(active & (1u << lane))) continue;
+    auto t0 = rays.tmin[lane], t1 = rays.tmax[lane];
+    for (auto axis = 0; axis < 3; axis++) {
+      auto a = (bbox.min[axis] - rays.o[axis][lane]) * rays.dinv[axis][lane];
+      auto b = (bbox.max[axis] - rays.o[axis][lane]) * rays.dinv[axis][lane];
+      t0     = max(t0, min(a, b));
+      t1     = min(t1, max(a, b));
+    }
+    t1 *= 1.00000024f;
+    if (t0 <= t1) mask |= 1u << lane;
+  }
+#endif
+  return mask & active;
+}
+
+// Intersect a packet of rays with a bvh, calling
+// `intersect_leaf(start, num, rays, mask)` for the leaves. The leaf function
+// returns the mask of the rays that hit a primitive and updates their tmax.
+// Nodes are visited while any ray is active, in the order of the first one.
+// Returns the mask of the rays that hit.
+template <int N, typename Func>
+static uint32_t intersect_packet_bvh(const bvh_tree* bvh, ray3f* rays,
+    uint32_t active, bool find_any, Func&& intersect_leaf) {
+  // check empty
+  if (bvh->nodes.empty() || !active) return 0;
+
+  // prepare rays for fast queries
+  auto soa = bvh_packet_rays<N>{};
+  for (auto lane = 0; lane < N; lane++) {
+    for (auto axis = 0; axis < 3; axis++) {
+      soa.o[axis][lane]    = rays[lane].o[axis];
+      soa.dinv[axis][lane] = 1 / rays[lane].d[axis];
+    }
+    soa.tmin[lane] = rays[lane].tmin;
+    soa.tmax[lane] = rays[lane].tmax;
+  }
+  auto first = 0;
+  while (!(active & (1u << first))) first++;
+  auto ray_dsign = vec3i{(soa.dinv[0][first] < 0) ? 1 : 0,
+      (soa.dinv[1][first] < 0) ? 1 : 0, (soa.dinv[2][first] < 0) ? 1 : 0};
+
+  // node stack, with the mask of rays entering each node
+  int      node_stack[bvh_binary_stack];
+  uint32_t mask_stack[bvh_binary_stack];
+  auto     node_cur      = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur++] = active;
+
+  // shared variables
+  auto hits = 0u;
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    node_cur--;
+    auto& node = bvh->nodes[node_stack[node_cur]];
+
+    // intersect bbox
+    auto mask = intersect_packet_bbox(
+        node.bbox, soa, mask_stack[node_cur] & active);
+    if (!mask) continue;
+
     // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
     if (node.internal) {
       // for internal nodes, attempts to proceed along the
       // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
-    } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto object_ = scene->objects[scene->bvh->primitives[idx]];
-        auto inv_ray = transform_ray(
-            inverse(object_->frame, non_rigid_frames), ray);
-        if (intersect_shape_bvh(
-                object_->shape, inv_ray, element, uv, distance, find_any)) {
-          hit      = true;
-          object   = scene->bvh->primitives[idx];
-          ray.tmax = distance;
-        }
+      auto first = node.start + 1, second = node.start + 0;
+      if (ray_dsign[node.axis]) std::swap(first, second);
+      node_stack[node_cur]   = first;
+      mask_stack[node_cur++] = mask;
+      node_stack[node_cur]   = second;
+      mask_stack[node_cur++] = mask;
+    } else if (auto leaf_hits = intersect_leaf(
+                   node.start, node.num, rays, mask)) {
+      hits |= leaf_hits;
+      for (auto lane = 0; lane < N; lane++) {
+        if (leaf_hits & (1u << lane)) soa.tmax[lane] = rays[lane].tmax;
       }
+      // rays that found any hit are done
+      if (find_any) active &= ~leaf_hits;
+      if (!active) return hits;
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
-  return hit;
+  return hits;
+}
+
+// Intersect a packet of rays with a shape bvh.
+template <int N>
+static uint32_t intersect_shape_bvh(ptr::shape* shape, ray3f* rays,
+    uint32_t active, int* element, vec2f* uv, float* distance,
+    bool find_any) {
+  return visit_bvh_leaf(shape->bvh->leaf, [&](auto leaf) {
+    return intersect_packet_bvh<N>(shape->bvh, rays, active, find_any,
+        [&](int start, int num, ray3f* rays, uint32_t mask) {
+          auto hits = 0u;
+          for (auto lane = 0; lane < N; lane++) {
+            if (!(mask & (1u << lane))) continue;
+            if (intersect_shape_leaf<decltype(leaf)::value>(shape, start, num,
+                    rays[lane], element[lane], uv[lane], distance[lane]))
+              hits |= 1u << lane;
+          }
+          return hits;
+        });
+  });
+}
+
+// Intersect a packet of rays with the scene bvh. Each object of a leaf is
+// intersected with the packet of active rays in its local frame.
+template <int N>
+static uint32_t intersect_scene_bvh(const ptr::scene* scene, ray3f* rays,
+    uint32_t active, int* object, int* element, vec2f* uv, float* distance,
+    bool find_any) {
+  return intersect_packet_bvh<N>(scene->bvh, rays, active, find_any,
+      [&](int start, int num, ray3f* rays, uint32_t mask) {
+        auto hits = 0u;
+        for (auto idx = start; idx < start + num && mask; idx++) {
+          auto  object_ = scene->objects[scene->bvh->primitives[idx]];
+          auto& frame   = object_->inv_frame;
+          ray3f inv_rays[N];
+          for (auto lane = 0; lane < N; lane++) {
+            if (mask & (1u << lane))
+              inv_rays[lane] = transform_ray(frame, rays[lane]);
+          }
+          auto object_hits = intersect_shape_bvh<N>(object_->shape, inv_rays,
+              mask, element, uv, distance, find_any);
+          for (auto lane = 0; lane < N; lane++) {
+            if (!(object_hits & (1u << lane))) continue;
+            object[lane]    = scene->bvh->primitives[idx];
+            rays[lane].tmax = distance[lane];
+          }
+          hits |= object_hits;
+          if (find_any) mask &= ~object_hits;
+        }
+        return hits;
+      });
 }
 
 // Intersect ray with a bvh->
 static bool intersect_instance_bvh(const ptr::object* object, const ray3f& ray,
-    int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto inv_ray = transform_ray(inverse(object->frame, non_rigid_frames), ray);
+    int& element, vec2f& uv, float& distance, bool find_any) {
+  auto inv_ray = transform_ray(object->inv_frame, ray);
   return intersect_shape_bvh(
       object->shape, inv_ray, element, uv, distance, find_any);
 }
 
 intersection3f intersect_scene_bvh(const ptr::scene* scene, const ray3f& ray,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any, bool /* non_rigid_frames */) {
   auto intersection = intersection3f{};
   intersection.hit  = intersect_scene_bvh(scene, ray, intersection.object,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      intersection.element, intersection.uv, intersection.distance, find_any);
   return intersection;
 }
 intersection3f intersect_instance_bvh(const ptr::object* object,
-    const ray3f& ray, bool find_any, bool non_rigid_frames) {
+    const ray3f& ray, bool find_any, bool /* non_rigid_frames */) {
   auto intersection = intersection3f{};
   intersection.hit  = intersect_instance_bvh(object, ray, intersection.element,
-      intersection.uv, intersection.distance, find_any, non_rigid_frames);
+      intersection.uv, intersection.distance, find_any);
   return intersection;
 }
 
+template <int N>
+std::array<intersection3f, N> intersect_scene_bvh(const ptr::scene* scene,
+    const ray_packet<N>& packet, bool find_any) {
+  auto  intersections = std::array<intersection3f, N>{};
+  ray3f rays[N];
+  int   object[N], element[N];
+  vec2f uv[N];
+  float distance[N];
+  for (auto lane = 0; lane < N; lane++) rays[lane] = packet.rays[lane];
+  auto hits = intersect_scene_bvh<N>(scene, rays, packet.active, object,
+      element, uv, distance, find_any);
+  for (auto lane = 0; lane < N; lane++) {
+    if (!(hits & (1u << lane))) continue;
+    intersections[lane] = {
+        object[lane], element[lane], uv[lane], distance[lane], true};
+  }
+  return intersections;
+}
+template <int N>
+std::array<intersection3f, N> intersect_instance_bvh(const ptr::object* object,
+    const ray_packet<N>& packet, bool find_any) {
+  auto  intersections = std::array<intersection3f, N>{};
+  auto& frame         = object->inv_frame;
+  ray3f inv_rays[N];
+  int   element[N];
+  vec2f uv[N];
+  float distance[N];
+  for (auto lane = 0; lane < N; lane++)
+    inv_rays[lane] = transform_ray(frame, packet.rays[lane]);
+  auto hits = intersect_shape_bvh<N>(object->shape, inv_rays, packet.active,
+      element, uv, distance, find_any);
+  for (auto lane = 0; lane < N; lane++) {
+    if (!(hits & (1u << lane))) continue;
+    intersections[lane] = {-1, element[lane], uv[lane], distance[lane], true};
+  }
+  return intersections;
+}
+
+// Explicit instantiations of the packet sizes
+template std::array<intersection3f, 4> intersect_scene_bvh<4>(
+    const ptr::scene*, const ray_packet<4>&, bool);
+template std::array<intersection3f, 8> intersect_scene_bvh<8>(
+    const ptr::scene*, const ray_packet<8>&, bool);
+template std::array<intersection3f, 16> intersect_scene_bvh<16>(
+    const ptr::scene*, const ray_packet<16>&, bool);
+template std::array<intersection3f, 4> intersect_instance_bvh<4>(
+    const ptr::object*, const ray_packet<4>&, bool);
+template std::array<intersection3f, 8> intersect_instance_bvh<8>(
+    const ptr::object*, const ray_packet<8>&, bool);
+template std::array<intersection3f, 16> intersect_instance_bvh<16>(
+    const ptr::object*, const ray_packet<16>&, bool);
+
+std::vector<intersection3f> intersect_scene_bvh(const ptr::scene* scene,
+    const std::vector<ray3f>& rays, bool find_any) {
+  auto intersections = std::vector<intersection3f>(rays.size());
+  for (auto start = 0; start < (int)rays.size(); start += 8) {
+    auto packet = ray_packet8{};
+    auto num    = min(8, (int)rays.size() - start);
+    for (auto lane = 0; lane < num; lane++)
+      packet.rays[lane] = rays[start + lane];
+    packet.active = (1u << num) - 1;
+    auto packet_intersections = intersect_scene_bvh(scene, packet, find_any);
+    for (auto lane = 0; lane < num; lane++)
+      intersections[start + lane] = packet_intersections[lane];
+  }
+  return intersections;
+}
+
+// Simulated data cache, with 64 byte lines and 8-way sets replaced in least
+// recently used order, for a total of 32kb as a typical L1 cache.
+struct bvh_cache_sim {
+  static const int sets = 64, ways = 8;
+  uintptr_t        lines[sets][ways] = {};
+  size_t           misses            = 0;
+
+  void access(const void* data) {
+    auto line = (uintptr_t)data / 64 + 1;
+    auto set  = lines[line % sets];
+    auto way  = 0;
+    while (way < ways - 1 && set[way] != line) way++;
+    if (set[way] != line) misses += 1;
+    for (; way > 0; way--) set[way] = set[way - 1];
+    set[0] = line;
+  }
+};
+
+// Intersect a ray with the binary nodes of a bvh, as intersect_shape_bvh(),
+// recording node accesses in a simulated cache.
+template <typename Func>
+static bool intersect_bvh_cache(const bvh_tree* bvh, ray3f& ray,
+    bvh_cache_sim& cache, Func&& intersect_leaf) {
+  if (bvh->nodes.empty()) return false;
+  int  node_stack[bvh_binary_stack];
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+  auto hit               = false;
+  auto ray_dinv          = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign         = vec3i{(ray_dinv.x < 0) ? 1 : 0,
+      (ray_dinv.y < 0) ? 1 : 0, (ray_dinv.z < 0) ? 1 : 0};
+  while (node_cur) {
+    auto& node = bvh->nodes[node_stack[--node_cur]];
+    cache.access(&node);
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    if (node.internal) {
+      if (ray_dsign[node.axis]) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else if (intersect_leaf(node.start, node.num, ray)) {
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+float get_bvh_cache_misses(const ptr::scene* scene, const ptr::camera* camera,
+    const trace_params& params) {
+  auto image_size =
+      (camera->film.x > camera->film.y)
+          ? vec2i{params.resolution,
+                (int)round(params.resolution * camera->film.y / camera->film.x)}
+          : vec2i{
+                (int)round(params.resolution * camera->film.x / camera->film.y),
+                params.resolution};
+  auto cache = bvh_cache_sim{};
+  for (auto j = 0; j < image_size.y; j++) {
+    for (auto i = 0; i < image_size.x; i++) {
+      auto ray = sample_camera(
+          camera, {i, j}, image_size, {0.5f, 0.5f}, {0.5f, 0.5f});
+      auto element  = 0;
+      auto uv       = zero2f;
+      auto distance = 0.0f;
+      intersect_bvh_cache(scene->bvh, ray, cache,
+          [&](int start, int num, ray3f& ray) {
+            auto hit = false;
+            for (auto idx = start; idx < start + num; idx++) {
+              auto object  = scene->objects[scene->bvh->primitives[idx]];
+              auto inv_ray = transform_ray(object->inv_frame, ray);
+              auto shape   = object->shape;
+              auto hit_shape = visit_bvh_leaf(shape->bvh->leaf, [&](auto leaf) {
+                return intersect_bvh_cache(shape->bvh, inv_ray, cache,
+                    [&](int start, int num, ray3f& ray) {
+                      return intersect_shape_leaf<decltype(leaf)::value>(
+                          shape, start, num, ray, element, uv, distance);
+                    });
+              });
+              if (hit_shape) {
+                hit      = true;
+                ray.tmax = distance;
+              }
+            }
+            return hit;
+          });
+    }
+  }
+  return (float)cache.misses / (image_size.x * image_size.y);
+}
+
 }  // namespace yocto::pathtrace
 
 // -----------------------------------------------------------------------------
@@ -1061,23 +3502,159 @@ static float sample_delta_pdf(const ptr::brdf& brdf, const vec3f& normal,
   return pdf;
 }
 
-// Sample lights wrt solid angle
+// Random numbers used to pick light elements
+static vec4f rand4f(rng_state& rng) {
+  auto x = rand1f(rng), y = rand1f(rng), z = rand1f(rng);
+  return {x, y, z, rand1f(rng)};
+}
+
+// Sample an alias table of `size` entries. The entry is picked with `r` and
+// kept or replaced by its alias with the independent random number `ra`, so
+// that the choice keeps its precision for tables of any size.
+static int sample_alias(
+    const alias_entry* alias, int size, float r, float ra) {
+  auto idx = clamp((int)(r * size), 0, size - 1);
+  return ra < alias[idx].prob ? idx : alias[idx].alias;
+}
+
+// Sample an alias table
+int sample_alias(const std::vector<alias_entry>& alias, float r, float ra) {
+  return sample_alias(alias.data(), (int)alias.size(), r, ra);
+}
+
+// Weight of an environment texel, as used to build its distribution
+static float environment_weight(const ptr::texture* texture, const vec2i& ij) {
+  auto size = texture_size(texture);
+  return max(lookup_texture(texture, ij)) * sin((ij.y + 0.5f) * pif / size.y);
+}
+
+// Cosine of the difference of two angles, clamped to zero
+static float cos_sub_clamped(
+    float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) return 1;
+  return cos_a * cos_b + sin_a * sin_b;
+}
+
+// Sine of the difference of two angles, clamped to zero
+static float sin_sub_clamped(
+    float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) return 0;
+  return sin_a * cos_b - cos_a * sin_b;
+}
+
+// Importance of a light bvh node for a shading point. It bounds the power
+// received from the node, using the smallest angle between the normal cone
+// and the direction to the point, reduced by the angle the node bounds
+// subtend. Emitters are two-sided, so normals are compared up to sign.
+static float light_importance(const light_node& node, const vec3f& position) {
+  if (node.power <= 0) return 0;
+  auto center    = (node.bbox.min + node.bbox.max) / 2;
+  auto radius2   = distance_squared(node.bbox.max, center);
+  auto center2   = distance_squared(position, center);
+  auto distance2 = max(center2, sqrt(radius2));
+
+  // angle subtended by the bounds, with points inside seeing all normals
+  if (center2 <= radius2) return node.power / distance2;
+  auto sin2_b = radius2 / center2;
+  auto sin_b  = sqrt(sin2_b);
+  auto cos_b  = sqrt(max(1 - sin2_b, 0.0f));
+
+  // angle between the cone axis and the direction to the point
+  auto cos_w = abs(dot(node.axis, normalize(position - center)));
+  auto sin_w = sqrt(max(1 - cos_w * cos_w, 0.0f));
+  auto cos_o = node.cos_theta;
+  auto sin_o = sqrt(max(1 - cos_o * cos_o, 0.0f));
+
+  // angle of the closest normal, which must face the point
+  auto cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+  auto sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+  auto cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+  if (cos_p <= 0) return 0;
+  return node.power * cos_p / distance2;
+}
+
+// Pick a light for a shading point. Without a light bvh, lights are picked
+// uniformly. Otherwise, an environment or the tree is picked uniformly and
+// the tree is descended choosing children by importance, rescaling the
+// random number at each level. Returns -1 if no light contributes.
+static int sample_light(
+    const ptr::scene* scene, const vec3f& position, float rl) {
+  auto tree = scene->light_bvh;
+  if (!tree) return sample_uniform(scene->lights.size(), rl);
+  auto num = (int)tree->environments.size() + (tree->nodes.empty() ? 0 : 1);
+  auto idx = sample_uniform(num, rl);
+  if (idx < tree->environments.size()) return tree->environments[idx];
+  rl       = min(rl * num - idx, 1 - 1e-6f);
+  auto cur = 0;
+  while (tree->nodes[cur].internal) {
+    auto& node  = tree->nodes[cur];
+    auto  left  = light_importance(tree->nodes[node.start], position);
+    auto  right = light_importance(tree->nodes[node.start + 1], position);
+    if (left + right <= 0) return -1;
+    auto prob = left / (left + right);
+    if (rl < prob) {
+      cur = node.start;
+      rl  = min(rl / prob, 1 - 1e-6f);
+    } else {
+      cur = node.start + 1;
+      rl  = min((rl - prob) / (1 - prob), 1 - 1e-6f);
+    }
+  }
+  return tree->nodes[cur].start;
+}
+
+// Probability of picking a light in sample_light(), computed by walking
+// from the leaf of the light to the root.
+static float sample_light_pdf(
+    const ptr::scene* scene, const vec3f& position, int light_id) {
+  auto tree = scene->light_bvh;
+  if (!tree) return sample_uniform_pdf(scene->lights.size());
+  auto num  = (int)tree->environments.size() + (tree->nodes.empty() ? 0 : 1);
+  auto prob = 1.0f / num;
+  auto cur  = tree->leaves[light_id];
+  if (cur < 0) return prob;
+  while (tree->nodes[cur].parent >= 0) {
+    auto& parent = tree->nodes[tree->nodes[cur].parent];
+    auto  left   = light_importance(tree->nodes[parent.start], position);
+    auto  right  = light_importance(tree->nodes[parent.start + 1], position);
+    if (left + right <= 0) return 0;
+    prob *= (cur == parent.start ? left : right) / (left + right);
+    cur = tree->nodes[cur].parent;
+  }
+  return prob;
+}
+
+// Light sampled by sample_lights(), with the point sampled on mesh lights.
+// Environments have no element.
+struct light_sample {
+  int   light   = -1;
+  int   element = -1;
+  vec2f uv      = {0, 0};
+};
+
+// Sample lights wrt solid angle, returning the sampled mesh light point.
+// Triangles use the first two random numbers of `rel` for the alias index
+// and coin, while environments pick a row and a column with all four. The
+// point within the triangle or texel is sampled with `ruv`.
 static vec3f sample_lights(const ptr::scene* scene, const vec3f& position,
-    float rl, float rel, const vec2f& ruv) {
-  auto  light_id = sample_uniform(scene->lights.size(), rl);
-  auto& light    = scene->lights[light_id];
+    float rl, const vec4f& rel, const vec2f& ruv, light_sample& sample) {
+  auto light_id = sample_light(scene, position, rl);
+  if (light_id < 0) return zero3f;
+  auto& light = scene->lights[light_id];
   if (light->object) {
-    auto element   = sample_discrete_cdf(light->cdf, rel);
+    auto element   = sample_alias(light->alias, rel.x, rel.y);
     auto uv        = sample_triangle(ruv);
+    sample         = {light_id, element, uv};
     auto lposition = eval_position(light->object, element, uv);
     return normalize(lposition - position);
   } else if (light->environment) {
+    sample = {light_id};
     if (light->environment->emission_tex) {
       auto emission_tex = light->environment->emission_tex;
-      auto idx          = sample_discrete_cdf(light->cdf, rel);
       auto size         = texture_size(emission_tex);
-      auto uv           = vec2f{
-          (idx % size.x + 0.5f) / size.x, (idx / size.x + 0.5f) / size.y};
+      auto j  = sample_alias(light->marginal.data(), size.y, rel.x, rel.y);
+      auto i  = sample_alias(&light->alias[j * size.x], size.x, rel.z, rel.w);
+      auto uv = vec2f{(i + ruv.x) / size.x, (j + ruv.y) / size.y};
       return transform_direction(light->environment->frame,
           {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
               sin(uv.x * 2 * pif) * sin(uv.y * pif)});
@@ -1089,77 +3666,324 @@ static vec3f sample_lights(const ptr::scene* scene, const vec3f& position,
   }
 }
 
-// Sample lights pdf
-static float sample_lights_pdf(
-    const ptr::scene* scene, const vec3f& position, const vec3f& direction) {
-  auto pdf = 0.0f;
-  for (auto& light : scene->lights) {
-    if (light->object) {
-      // check all intersection
-      auto lpdf          = 0.0f;
-      auto next_position = position;
-      for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_instance_bvh(
-            light->object, {next_position, direction});
-        if (!intersection.hit) break;
-        // accumulate pdf
-        auto lposition = eval_position(
-            light->object, intersection.element, intersection.uv);
-        auto lnormal = eval_element_normal(light->object, intersection.element);
-        // prob triangle * area triangle = area triangle mesh
-        auto area = light->cdf.back();
-        lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
-        // continue
-        next_position = lposition + direction * 1e-3f;
+// Rays traced by the exact light pdf evaluation
+static std::atomic<int64_t> light_pdf_rays = 0;
+
+// Pdf of an environment light wrt solid angle
+static float environment_pdf(const ptr::light* light, const vec3f& direction) {
+  if (light->environment->emission_tex) {
+    auto emission_tex = light->environment->emission_tex;
+    auto size         = texture_size(emission_tex);
+    auto wl           = transform_direction(
+        inverse(light->environment->frame), direction);
+    auto texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
+        acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+    if (texcoord.x < 0) texcoord.x += 1;
+    auto i    = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
+    auto j    = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
+    auto prob = environment_weight(emission_tex, {i, j}) / light->weight;
+    // texel uv area over its solid angle at the direction
+    auto sin_theta = sqrt(max(1 - wl.y * wl.y, 0.0f));
+    if (sin_theta == 0) return 0;
+    return prob * size.x * size.y / (2 * pif * pif * sin_theta);
+  } else {
+    return 1 / (4 * pif);
+  }
+}
+
+// Pdf of a point on a mesh light wrt solid angle
+static float mesh_light_pdf(const ptr::light* light, const vec3f& position,
+    const vec3f& direction, int element, const vec2f& uv) {
+  auto lposition = eval_position(light->object, element, uv);
+  auto lnormal   = eval_element_normal(light->object, element);
+  // prob triangle * area triangle = area triangle mesh
+  auto area = light->cdf.back();
+  return distance_squared(lposition, position) /
+         (abs(dot(lnormal, direction)) * area);
+}
+
+// Sample lights pdf, tracing each mesh light to accumulate the pdf of all
+// its points along the direction.
+static float sample_lights_pdf(
+    const ptr::scene* scene, const vec3f& position, const vec3f& direction) {
+  auto pdf  = 0.0f;
+  auto rays = 0;
+  for (auto light_id = 0; light_id < scene->lights.size(); light_id++) {
+    auto light = scene->lights[light_id];
+    if (light->object) {
+      // check all intersection
+      auto lpdf          = 0.0f;
+      auto next_position = position;
+      for (auto bounce = 0; bounce < 100; bounce++) {
+        auto intersection = intersect_instance_bvh(
+            light->object, {next_position, direction});
+        rays += 1;
+        if (!intersection.hit) break;
+        // accumulate pdf
+        lpdf += mesh_light_pdf(light, position, direction,
+            intersection.element, intersection.uv);
+        // continue
+        next_position = eval_position(light->object, intersection.element,
+                            intersection.uv) +
+                        direction * 1e-3f;
+      }
+      if (lpdf) pdf += lpdf * sample_light_pdf(scene, position, light_id);
+    } else if (light->environment) {
+      pdf += environment_pdf(light, direction) *
+             sample_light_pdf(scene, position, light_id);
+    }
+  }
+  light_pdf_rays += rays;
+  return pdf;
+}
+
+// Pdf of sampling the visible light point along the direction, given the
+// intersection of the ray along it. Only the first surface hit is counted.
+static float visible_lights_pdf(const ptr::scene* scene,
+    const vec3f& position, const vec3f& direction,
+    const intersection3f& intersection) {
+  auto pdf = 0.0f;
+  if (intersection.hit && scene->light_ids[intersection.object] >= 0) {
+    auto light_id = scene->light_ids[intersection.object];
+    pdf += mesh_light_pdf(scene->lights[light_id], position, direction,
+               intersection.element, intersection.uv) *
+           sample_light_pdf(scene, position, light_id);
+  }
+  for (auto light_id = 0; light_id < scene->lights.size(); light_id++) {
+    auto light = scene->lights[light_id];
+    if (!light->environment) continue;
+    pdf += environment_pdf(light, direction) *
+           sample_light_pdf(scene, position, light_id);
+  }
+  return pdf;
+}
+
+// Sample lights pdf, reusing the intersection of the ray along the
+// direction instead of tracing the mesh lights. This is the pdf of the
+// visible light points, so light samples that are hidden must end the path,
+// see is_light_sample_visible(). Uses the exact pdf if `params.exact_pdf`
+// is set.
+static float sample_lights_pdf(const ptr::scene* scene,
+    const trace_params& params, const vec3f& position, const vec3f& direction,
+    const intersection3f& intersection) {
+  if (params.exact_pdf)
+    return sample_lights_pdf(scene, position, direction);
+  return visible_lights_pdf(scene, position, direction, intersection);
+}
+
+// Check whether a point sampled on a mesh light is the first hit of its ray,
+// as required by the hit-based light pdf. Rays hit triangles at most once,
+// so the triangle identifies the point.
+static bool is_light_sample_visible(const ptr::scene* scene,
+    const trace_params& params, const light_sample& sample,
+    const intersection3f& intersection) {
+  if (params.exact_pdf || sample.element < 0) return true;
+  return intersection.hit &&
+         scene->light_ids[intersection.object] == sample.light &&
+         intersection.element == sample.element;
+}
+
+// Rays traced by the exact light pdf evaluation
+int64_t get_light_pdf_rays() { return light_pdf_rays; }
+
+// Check whether a shadow ray reaches `tmax` unoccluded. Blockers found by
+// occluded() are intersected to let the ray go through surfaces with
+// opacity, with the same probability used by paths.
+static bool trace_shadow(const ptr::scene* scene, const ray3f& ray_,
+    float tmax, rng_state& rng) {
+  auto ray = ray3f{ray_.o, ray_.d, ray_.tmin, tmax};
+  for (auto layer = 0; layer < 100; layer++) {
+    if (!occluded(scene, ray, ray.tmax)) return true;
+    auto intersection = intersect_scene_bvh(scene, ray);
+    if (!intersection.hit) return true;
+    auto object = scene->objects[intersection.object];
+    if (rand1f(rng) < eval_opacity(
+                          object, intersection.element, intersection.uv))
+      return false;
+    ray.tmin = intersection.distance + 1e-2f;
+    if (ray.tmin >= ray.tmax) return true;
+  }
+  return false;
+}
+
+static vec3f eval_scattering(
+    const ptr::vsdf& vsdf, const vec3f& outgoing, const vec3f& incoming) {
+  if (vsdf.density == zero3f) return zero3f;
+  return vsdf.scatter * vsdf.density *
+         eval_phasefunction(vsdf.anisotropy, outgoing, incoming);
+}
+
+static vec3f sample_scattering(
+    const ptr::vsdf& vsdf, const vec3f& outgoing, float rnl, const vec2f& rn) {
+  if (vsdf.density == zero3f) return zero3f;
+  return sample_phasefunction(vsdf.anisotropy, outgoing, rn);
+}
+
+static float sample_scattering_pdf(
+    const ptr::vsdf& vsdf, const vec3f& outgoing, const vec3f& incoming) {
+  if (vsdf.density == zero3f) return 0;
+  return sample_phasefunction_pdf(vsdf.anisotropy, outgoing, incoming);
+}
+
+// Path tracing. The ray of the next bounce is intersected as soon as its
+// direction is sampled, so that the light pdf can reuse its hit. Hidden
+// light samples then end the path, unless using exact light pdfs.
+static vec4f trace_path(const ptr::scene* scene, const ray3f& ray_,
+    rng_state& rng, const trace_params& params) {
+  // initialize
+  auto radiance     = zero3f;
+  auto weight       = vec3f{1, 1, 1};
+  auto ray          = ray_;
+  auto volume_stack = std::vector<vsdf>{};
+  auto hit          = false;
+  auto intersection = params.bounces > 0 ? intersect_scene_bvh(scene, ray)
+                                         : intersection3f{};
+
+  // trace  path
+  for (auto bounce = 0; bounce < params.bounces; bounce++) {
+    // check next point
+    if (!intersection.hit) {
+      radiance += weight * eval_environment(scene, ray);
+      break;
+    }
+
+    // handle transmission if inside a volume
+    auto in_volume = false;
+    if (!volume_stack.empty()) {
+      auto& vsdf     = volume_stack.back();
+      auto  distance = sample_transmittance(
+          vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+      weight *= eval_transmittance(vsdf.density, distance) /
+                sample_transmittance_pdf(
+                    vsdf.density, distance, intersection.distance);
+      in_volume             = distance < intersection.distance;
+      intersection.distance = distance;
+    }
+
+    // switch between surface and volume
+    if (!in_volume) {
+      // prepare shading point
+      auto outgoing = -ray.d;
+      auto object   = scene->objects[intersection.object];
+      auto element  = intersection.element;
+      auto uv       = intersection.uv;
+      auto position = eval_position(object, element, uv);
+      auto normal   = eval_shading_normal(object, element, uv, outgoing);
+      auto emission = eval_emission(object, element, uv, normal, outgoing);
+      auto brdf     = eval_brdf(object, element, uv, normal, outgoing);
+
+      // handle opacity
+      if (brdf.opacity < 1 && rand1f(rng) >= brdf.opacity) {
+        ray          = {position + ray.d * 1e-2f, ray.d};
+        intersection = intersect_scene_bvh(scene, ray);
+        bounce -= 1;
+        continue;
+      }
+      hit = true;
+
+      // accumulate emission
+      radiance += weight * eval_emission(emission, normal, outgoing);
+
+      // next direction
+      auto incoming = zero3f;
+      auto next     = intersection3f{};
+      if (!is_delta(brdf)) {
+        auto sample = light_sample{};
+        if (rand1f(rng) < 0.5f) {
+          incoming = sample_brdfcos(
+              brdf, normal, outgoing, rand1f(rng), rand2f(rng));
+        } else {
+          incoming = sample_lights(
+              scene, position, rand1f(rng), rand4f(rng), rand2f(rng), sample);
+        }
+        if (bounce + 1 < params.bounces)
+          next = intersect_scene_bvh(scene, {position, incoming});
+        weight *= eval_brdfcos(brdf, normal, outgoing, incoming) /
+                  (0.5f * sample_brdfcos_pdf(brdf, normal, outgoing, incoming) +
+                      0.5f * sample_lights_pdf(
+                                 scene, params, position, incoming, next));
+        if (bounce + 1 < params.bounces &&
+            !is_light_sample_visible(scene, params, sample, next))
+          weight = zero3f;
+      } else {
+        incoming = sample_delta(brdf, normal, outgoing, rand1f(rng));
+        weight *= eval_delta(brdf, normal, outgoing, incoming) /
+                  sample_delta_pdf(brdf, normal, outgoing, incoming);
+        if (bounce + 1 < params.bounces)
+          next = intersect_scene_bvh(scene, {position, incoming});
+      }
+
+      // update volume stack
+      if (has_volume(object) &&
+          dot(normal, outgoing) * dot(normal, incoming) < 0) {
+        if (volume_stack.empty()) {
+          auto volpoint = eval_vsdf(object, element, uv);
+          volume_stack.push_back(volpoint);
+        } else {
+          volume_stack.pop_back();
+        }
       }
-      pdf += lpdf;
-    } else if (light->environment) {
-      if (light->environment->emission_tex) {
-        auto emission_tex = light->environment->emission_tex;
-        auto size         = texture_size(emission_tex);
-        auto wl           = transform_direction(
-            inverse(light->environment->frame), direction);
-        auto texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto i    = clamp((int)(texcoord.x * size.x), 0, size.x - 1);
-        auto j    = clamp((int)(texcoord.y * size.y), 0, size.y - 1);
-        auto prob = sample_discrete_cdf_pdf(light->cdf, j * size.x + i) /
-                    light->cdf.back();
-        auto angle = (2 * pif / size.x) * (pif / size.y) *
-                     sin(pif * (j + 0.5f) / size.y);
-        pdf += prob / angle;
+
+      // setup next iteration
+      ray          = {position, incoming};
+      intersection = next;
+    } else {
+      // prepare shading point
+      auto  outgoing = -ray.d;
+      auto  position = ray.o + ray.d * intersection.distance;
+      auto& vsdf     = volume_stack.back();
+
+      // handle opacity
+      hit = true;
+
+      // accumulate emission
+      // radiance += weight * eval_volemission(vsdf, outgoing);
+
+      // next direction
+      auto incoming = zero3f;
+      auto next     = intersection3f{};
+      auto sample   = light_sample{};
+      if (rand1f(rng) < 0.5f) {
+        incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
       } else {
-        pdf += 1 / (4 * pif);
+        incoming = sample_lights(
+            scene, position, rand1f(rng), rand4f(rng), rand2f(rng), sample);
       }
+      if (bounce + 1 < params.bounces)
+        next = intersect_scene_bvh(scene, {position, incoming});
+      weight *= eval_scattering(vsdf, outgoing, incoming) /
+                (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+                    0.5f * sample_lights_pdf(
+                               scene, params, position, incoming, next));
+      if (bounce + 1 < params.bounces &&
+          !is_light_sample_visible(scene, params, sample, next))
+        weight = zero3f;
+
+      // setup next iteration
+      ray          = {position, incoming};
+      intersection = next;
     }
-  }
-  pdf *= sample_uniform_pdf(scene->lights.size());
-  return pdf;
-}
 
-static vec3f eval_scattering(
-    const ptr::vsdf& vsdf, const vec3f& outgoing, const vec3f& incoming) {
-  if (vsdf.density == zero3f) return zero3f;
-  return vsdf.scatter * vsdf.density *
-         eval_phasefunction(vsdf.anisotropy, outgoing, incoming);
-}
+    // check weight
+    if (weight == zero3f || !isfinite(weight)) break;
 
-static vec3f sample_scattering(
-    const ptr::vsdf& vsdf, const vec3f& outgoing, float rnl, const vec2f& rn) {
-  if (vsdf.density == zero3f) return zero3f;
-  return sample_phasefunction(vsdf.anisotropy, outgoing, rn);
-}
+    // russian roulette
+    if (bounce > 3) {
+      auto rr_prob = min((float)0.99, max(weight));
+      if (rand1f(rng) >= rr_prob) break;
+      weight *= 1 / rr_prob;
+    }
+  }
 
-static float sample_scattering_pdf(
-    const ptr::vsdf& vsdf, const vec3f& outgoing, const vec3f& incoming) {
-  if (vsdf.density == zero3f) return 0;
-  return sample_phasefunction_pdf(vsdf.anisotropy, outgoing, incoming);
+  return {radiance, hit ? 1.0f : 0.0f};
 }
 
-// Path tracing.
-static vec4f trace_path(const ptr::scene* scene, const ray3f& ray_,
+// Path tracing with next event estimation. Each surface vertex traces a
+// shadow ray to a sampled light and continues with a brdf sample, combining
+// the two with the balance heuristic. Emission found by the brdf sample is
+// weighted when the next vertex is reached, since opacity may skip the
+// first hit. Inside volumes paths only sample the phase function.
+static vec4f trace_nee(const ptr::scene* scene, const ray3f& ray_,
     rng_state& rng, const trace_params& params) {
   // initialize
   auto radiance     = zero3f;
@@ -1167,13 +3991,19 @@ static vec4f trace_path(const ptr::scene* scene, const ray3f& ray_,
   auto ray          = ray_;
   auto volume_stack = std::vector<vsdf>{};
   auto hit          = false;
+  auto mis_position = zero3f;  // vertex of the last brdf sample
+  auto mis_pdf      = 0.0f;    // its pdf, or 0 if lights were not sampled
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
     // intersect next point
     auto intersection = intersect_scene_bvh(scene, ray);
     if (!intersection.hit) {
-      radiance += weight * eval_environment(scene, ray);
+      auto environment = eval_environment(scene, ray);
+      if (mis_pdf && environment != zero3f)
+        environment *= mis_pdf / (mis_pdf + visible_lights_pdf(scene,
+                                               mis_position, ray.d, {}));
+      radiance += weight * environment;
       break;
     }
 
@@ -1211,25 +4041,67 @@ static vec4f trace_path(const ptr::scene* scene, const ray3f& ray_,
       hit = true;
 
       // accumulate emission
-      radiance += weight * eval_emission(emission, normal, outgoing);
+      auto radiance_emitted = eval_emission(emission, normal, outgoing);
+      if (mis_pdf && radiance_emitted != zero3f)
+        radiance_emitted *= mis_pdf /
+                            (mis_pdf + visible_lights_pdf(scene, mis_position,
+                                           ray.d, intersection));
+      radiance += weight * radiance_emitted;
 
       // next direction
       auto incoming = zero3f;
       if (!is_delta(brdf)) {
-        if (rand1f(rng) < 0.5f) {
-          incoming = sample_brdfcos(
-              brdf, normal, outgoing, rand1f(rng), rand2f(rng));
-        } else {
-          incoming = sample_lights(
-              scene, position, rand1f(rng), rand1f(rng), rand2f(rng));
+        // sample lights with a shadow ray
+        auto next_event = bounce + 1 < params.bounces && volume_stack.empty();
+        if (next_event) {
+          auto sample    = light_sample{};
+          auto lincoming = sample_lights(
+              scene, position, rand1f(rng), rand4f(rng), rand2f(rng), sample);
+          auto brdfcos = sample.light >= 0
+                             ? eval_brdfcos(brdf, normal, outgoing, lincoming)
+                             : zero3f;
+          if (brdfcos != zero3f) {
+            auto light     = scene->lights[sample.light];
+            auto lemission = zero3f;
+            auto lpdf      = 0.0f;
+            auto ldistance = flt_max;
+            if (light->object) {
+              auto lposition = eval_position(
+                  light->object, sample.element, sample.uv);
+              auto lnormal = eval_shading_normal(
+                  light->object, sample.element, sample.uv, -lincoming);
+              lemission = eval_emission(
+                  eval_emission(light->object, sample.element, sample.uv,
+                      lnormal, -lincoming),
+                  lnormal, -lincoming);
+              lpdf = mesh_light_pdf(light, position, lincoming,
+                         sample.element, sample.uv) *
+                     sample_light_pdf(scene, position, sample.light);
+              ldistance = distance(lposition, position) - 1e-3f;
+            } else {
+              lemission = eval_environment(scene, {position, lincoming});
+              lpdf = visible_lights_pdf(scene, position, lincoming, {});
+            }
+            if (lemission != zero3f && lpdf > 0 &&
+                trace_shadow(scene, {position, lincoming}, ldistance, rng))
+              radiance += weight * brdfcos * lemission /
+                          (lpdf + sample_brdfcos_pdf(
+                                      brdf, normal, outgoing, lincoming));
+          }
         }
-        weight *= eval_brdfcos(brdf, normal, outgoing, incoming) /
-                  (0.5f * sample_brdfcos_pdf(brdf, normal, outgoing, incoming) +
-                      0.5f * sample_lights_pdf(scene, position, incoming));
+
+        // continue with a brdf sample
+        incoming = sample_brdfcos(
+            brdf, normal, outgoing, rand1f(rng), rand2f(rng));
+        auto pdf = sample_brdfcos_pdf(brdf, normal, outgoing, incoming);
+        weight *= eval_brdfcos(brdf, normal, outgoing, incoming) / pdf;
+        mis_position = position;
+        mis_pdf      = next_event ? pdf : 0;
       } else {
         incoming = sample_delta(brdf, normal, outgoing, rand1f(rng));
         weight *= eval_delta(brdf, normal, outgoing, incoming) /
                   sample_delta_pdf(brdf, normal, outgoing, incoming);
+        mis_pdf = 0;
       }
 
       // update volume stack
@@ -1254,20 +4126,12 @@ static vec4f trace_path(const ptr::scene* scene, const ray3f& ray_,
       // handle opacity
       hit = true;
 
-      // accumulate emission
-      // radiance += weight * eval_volemission(vsdf, outgoing);
-
       // next direction
-      auto incoming = zero3f;
-      if (rand1f(rng) < 0.5f) {
-        incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
-      } else {
-        incoming = sample_lights(
-            scene, position, rand1f(rng), rand1f(rng), rand2f(rng));
-      }
+      auto incoming = sample_scattering(
+          vsdf, outgoing, rand1f(rng), rand2f(rng));
       weight *= eval_scattering(vsdf, outgoing, incoming) /
-                (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
-                    0.5f * sample_lights_pdf(scene, position, incoming));
+                sample_scattering_pdf(vsdf, outgoing, incoming);
+      mis_pdf = 0;
 
       // setup next iteration
       ray = {position, incoming};
@@ -1440,6 +4304,8 @@ static shader_func get_trace_shader_func(const trace_params& params) {
   switch (params.shader) {
     case shader_type::naive: return trace_naive;
     case shader_type::path: return trace_path;
+    case shader_type::wavefront: return trace_path;
+    case shader_type::nee: return trace_nee;
     case shader_type::eyelight: return trace_eyelight;
     case shader_type::normal: return trace_normal;
     default: {
@@ -1449,6 +4315,23 @@ static shader_func get_trace_shader_func(const trace_params& params) {
   }
 }
 
+// Accumulate a sample in a pixel and return the pixel average
+static vec4f accumulate_sample(ptr::state* state, const vec2i& ij,
+    vec4f shaded, const trace_params& params) {
+  auto& pixel = state->pixels[ij];
+  if (!isfinite(xyz(shaded))) xyz(shaded) = zero3f;
+  if (max(xyz(shaded)) > params.clamp)
+    xyz(shaded) = xyz(shaded) * (params.clamp / max(xyz(shaded)));
+  pixel.accumulated += shaded;
+  pixel.samples += 1;
+  // running variance of the luminance with Welford's update
+  auto lum   = luminance(xyz(shaded));
+  auto delta = lum - pixel.mean;
+  pixel.mean += delta / pixel.samples;
+  pixel.m2 += delta * (lum - pixel.mean);
+  return pixel.accumulated / pixel.samples;
+}
+
 // Trace a block of samples
 vec4f trace_sample(ptr::state* state, const ptr::scene* scene,
     const ptr::camera* camera, const vec2i& ij, const trace_params& params) {
@@ -1457,17 +4340,466 @@ vec4f trace_sample(ptr::state* state, const ptr::scene* scene,
   auto  ray    = sample_camera(
       camera, ij, state->pixels.size(), rand2f(pixel.rng), rand2f(pixel.rng));
   auto shaded = shader(scene, ray, pixel.rng, params);
-  if (!isfinite(xyz(shaded))) xyz(shaded) = zero3f;
-  if (max(xyz(shaded)) > params.clamp)
-    xyz(shaded) = xyz(shaded) * (params.clamp / max(xyz(shaded)));
-  pixel.accumulated += shaded;
-  pixel.samples += 1;
-  return pixel.accumulated / pixel.samples;
+  return accumulate_sample(state, ij, shaded, params);
+}
+
+// Path state of the wavefront integrator. The volume stack of trace_path()
+// holds at most one volume, so it is stored inline. The MIS weight of a
+// sampled direction is pending until its ray is intersected, so that the
+// light pdf can reuse the hit.
+struct wavefront_path {
+  vec2i          ij           = {0, 0};
+  ray3f          ray          = {};
+  vec3f          radiance     = {0, 0, 0};
+  vec3f          weight       = {1, 1, 1};
+  int            bounce       = 0;
+  bool           hit          = false;
+  bool           inside       = false;  // volume stack is not empty
+  vsdf           volume       = {};
+  intersection3f intersection = {};
+  bool           pending      = false;      // MIS weight is pending
+  vec3f          pending_eval = {0, 0, 0};  // brdfcos or phase function
+  float          pending_pdf  = 0;          // half the brdfcos or phase pdf
+  light_sample   sample       = {};         // light point of the direction
+};
+
+// Spread the lower 10 bits of a value to every third bit.
+static uint32_t spread_bits3(uint32_t value) {
+  value = (value | (value << 16)) & 0x030000ff;
+  value = (value | (value << 8)) & 0x0300f00f;
+  value = (value | (value << 4)) & 0x030c30c3;
+  value = (value | (value << 2)) & 0x09249249;
+  return value;
+}
+
+// Sort key of a ray, made of the direction octant followed by the Morton
+// code of the origin quantized to 10 bits per axis in the scene bounds.
+// Rays with nearby keys visit similar bvh nodes.
+static uint32_t ray_sort_key(const ray3f& ray, const bbox3f& bbox) {
+  auto octant = (ray.d.x < 0 ? 1u : 0u) | (ray.d.y < 0 ? 2u : 0u) |
+                (ray.d.z < 0 ? 4u : 0u);
+  auto cell   = clamp((ray.o - bbox.min) / max(bbox.max - bbox.min, 1e-6f),
+      0.0f, 1.0f) * 1023.0f;
+  return (octant << 29) | (spread_bits3((uint32_t)cell.z) << 2) |
+         (spread_bits3((uint32_t)cell.y) << 1) | spread_bits3((uint32_t)cell.x);
+}
+
+// Trace one sample for the pixels in [start, end) with a wavefront version
+// of trace_path(). Paths are advanced one stage at a time over queues of
+// path states: rays are extended in bulk with the stream intersection,
+// surface hits are shaded sorted by material, and volume scattering is
+// shaded last. Each path uses the random numbers of its pixel in the same
+// order of trace_path(), so the image is the same. If `params.ray_sort` is
+// set, rays are sorted by direction and origin before each intersection
+// round. Converged pixels are skipped if requested.
+static void trace_wavefront(ptr::state* state, const ptr::scene* scene,
+    const ptr::camera* camera, const vec2i& start, const vec2i& end,
+    const trace_params& params, bool skip_converged) {
+  // camera rays
+  auto paths = std::vector<wavefront_path>{};
+  paths.reserve((end.x - start.x) * (end.y - start.y));
+  for (auto j = start.y; j < end.y; j++) {
+    for (auto i = start.x; i < end.x; i++) {
+      auto& pixel = state->pixels[{i, j}];
+      if (skip_converged && pixel.converged) continue;
+      auto& path = paths.emplace_back();
+      path.ij    = {i, j};
+      path.ray   = sample_camera(camera, path.ij, state->pixels.size(),
+          rand2f(pixel.rng), rand2f(pixel.rng));
+    }
+  }
+
+  // stage queues, as indices into paths
+  auto extend  = std::vector<int>{};
+  auto surface = std::vector<int>{};
+  auto volume  = std::vector<int>{};
+  auto rays    = std::vector<ray3f>{};
+  if (params.bounces > 0) {
+    extend.resize(paths.size());
+    for (auto idx = 0; idx < paths.size(); idx++) extend[idx] = idx;
+  }
+
+  // apply the pending MIS weight, check weight and russian roulette
+  auto finish_bounce = [&](int idx, const intersection3f& next, bool traced) {
+    auto& path = paths[idx];
+    auto& rng  = state->pixels[path.ij].rng;
+    if (path.pending) {
+      path.weight *= path.pending_eval /
+                     (path.pending_pdf +
+                         0.5f * sample_lights_pdf(scene, params, path.ray.o,
+                                    path.ray.d, next));
+      if (traced && !is_light_sample_visible(scene, params, path.sample, next))
+        path.weight = zero3f;
+      path.pending = false;
+    }
+    if (path.weight == zero3f || !isfinite(path.weight)) return false;
+    if (path.bounce > 3) {
+      auto rr_prob = min((float)0.99, max(path.weight));
+      if (rand1f(rng) >= rr_prob) return false;
+      path.weight *= 1 / rr_prob;
+    }
+    return true;
+  };
+
+  // queue the next bounce, finishing the current one after intersection
+  // if its MIS weight is pending
+  auto next_bounce = [&](int idx) {
+    auto& path = paths[idx];
+    if (path.pending && path.bounce + 1 < params.bounces) {
+      extend.push_back(idx);
+      return;
+    }
+    if (!finish_bounce(idx, {}, false)) return;
+    if (++path.bounce < params.bounces) extend.push_back(idx);
+  };
+
+  auto keys  = std::vector<std::pair<uint32_t, int>>{};
+  auto round = 0;
+  while (!extend.empty()) {
+    auto round_start = std::chrono::steady_clock::now();
+
+    // sort rays for coherent traversal
+    if (params.ray_sort && !scene->bvh->nodes.empty()) {
+      auto& bbox = scene->bvh->nodes[0].bbox;
+      keys.resize(extend.size());
+      for (auto k = 0; k < extend.size(); k++)
+        keys[k] = {ray_sort_key(paths[extend[k]].ray, bbox), extend[k]};
+      std::sort(keys.begin(), keys.end());
+      for (auto k = 0; k < extend.size(); k++) extend[k] = keys[k].second;
+    }
+
+    // extend all paths
+    rays.resize(extend.size());
+    for (auto k = 0; k < extend.size(); k++) rays[k] = paths[extend[k]].ray;
+    auto intersections = intersect_scene_bvh(scene, rays);
+
+    // update bounce counters
+    if (round < state->ncounters) {
+      auto& counter = state->counters[round];
+      counter.rays += (int64_t)extend.size();
+      counter.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - round_start)
+                                 .count();
+    }
+    round += 1;
+
+    // handle misses and transmission, and split surface and volume hits
+    surface.clear();
+    volume.clear();
+    for (auto k = 0; k < extend.size(); k++) {
+      auto& path         = paths[extend[k]];
+      auto& rng          = state->pixels[path.ij].rng;
+      auto& intersection = intersections[k];
+      if (path.pending) {
+        if (!finish_bounce(extend[k], intersection, true)) continue;
+        path.bounce += 1;
+      }
+      if (!intersection.hit) {
+        path.radiance += path.weight * eval_environment(scene, path.ray);
+        continue;
+      }
+      auto in_volume = false;
+      if (path.inside) {
+        auto distance = sample_transmittance(path.volume.density,
+            intersection.distance, rand1f(rng), rand1f(rng));
+        path.weight *= eval_transmittance(path.volume.density, distance) /
+                       sample_transmittance_pdf(path.volume.density, distance,
+                           intersection.distance);
+        in_volume             = distance < intersection.distance;
+        intersection.distance = distance;
+      }
+      path.intersection = intersection;
+      (in_volume ? volume : surface).push_back(extend[k]);
+    }
+    extend.clear();
+
+    // shade surfaces, sorted by material for coherent shading
+    std::sort(surface.begin(), surface.end(), [&](int a, int b) {
+      return scene->objects[paths[a].intersection.object]->material <
+             scene->objects[paths[b].intersection.object]->material;
+    });
+    for (auto idx : surface) {
+      auto& path = paths[idx];
+      auto& rng  = state->pixels[path.ij].rng;
+
+      // prepare shading point
+      auto outgoing = -path.ray.d;
+      auto object   = scene->objects[path.intersection.object];
+      auto element  = path.intersection.element;
+      auto uv       = path.intersection.uv;
+      auto position = eval_position(object, element, uv);
+      auto normal   = eval_shading_normal(object, element, uv, outgoing);
+      auto emission = eval_emission(object, element, uv, normal, outgoing);
+      auto brdf     = eval_brdf(object, element, uv, normal, outgoing);
+
+      // handle opacity, without counting a bounce
+      if (brdf.opacity < 1 && rand1f(rng) >= brdf.opacity) {
+        path.ray = {position + path.ray.d * 1e-2f, path.ray.d};
+        extend.push_back(idx);
+        continue;
+      }
+      path.hit = true;
+
+      // accumulate emission
+      path.radiance += path.weight * eval_emission(emission, normal, outgoing);
+
+      // next direction
+      auto incoming = zero3f;
+      path.sample   = {};
+      if (!is_delta(brdf)) {
+        if (rand1f(rng) < 0.5f) {
+          incoming = sample_brdfcos(
+              brdf, normal, outgoing, rand1f(rng), rand2f(rng));
+        } else {
+          incoming = sample_lights(scene, position, rand1f(rng), rand4f(rng),
+              rand2f(rng), path.sample);
+        }
+        path.pending      = true;
+        path.pending_eval = eval_brdfcos(brdf, normal, outgoing, incoming);
+        path.pending_pdf  = 0.5f *
+                           sample_brdfcos_pdf(brdf, normal, outgoing, incoming);
+      } else {
+        incoming = sample_delta(brdf, normal, outgoing, rand1f(rng));
+        path.weight *= eval_delta(brdf, normal, outgoing, incoming) /
+                       sample_delta_pdf(brdf, normal, outgoing, incoming);
+      }
+
+      // update volume stack
+      if (has_volume(object) &&
+          dot(normal, outgoing) * dot(normal, incoming) < 0) {
+        if (!path.inside) path.volume = eval_vsdf(object, element, uv);
+        path.inside = !path.inside;
+      }
+
+      // setup next bounce
+      path.ray = {position, incoming};
+      next_bounce(idx);
+    }
+
+    // shade volumes
+    for (auto idx : volume) {
+      auto& path = paths[idx];
+      auto& rng  = state->pixels[path.ij].rng;
+
+      // prepare shading point
+      auto outgoing = -path.ray.d;
+      auto position = path.ray.o + path.ray.d * path.intersection.distance;
+      path.hit      = true;
+
+      // next direction
+      auto incoming = zero3f;
+      path.sample   = {};
+      if (rand1f(rng) < 0.5f) {
+        incoming = sample_scattering(
+            path.volume, outgoing, rand1f(rng), rand2f(rng));
+      } else {
+        incoming = sample_lights(scene, position, rand1f(rng), rand4f(rng),
+            rand2f(rng), path.sample);
+      }
+      path.pending      = true;
+      path.pending_eval = eval_scattering(path.volume, outgoing, incoming);
+      path.pending_pdf  = 0.5f *
+                         sample_scattering_pdf(path.volume, outgoing, incoming);
+
+      // setup next bounce
+      path.ray = {position, incoming};
+      next_bounce(idx);
+    }
+  }
+
+  // accumulate samples
+  for (auto& path : paths) {
+    state->render[path.ij] = accumulate_sample(
+        state, path.ij, {path.radiance, path.hit ? 1.0f : 0.0f}, params);
+  }
+}
+
+// Check whether the standard error of the pixel mean luminance, relative to
+// the mean, is below the threshold. Dark pixels use an absolute floor.
+static bool is_converged(const ptr::pixel& pixel, float threshold) {
+  if (pixel.samples < 2) return false;
+  auto error = sqrt(pixel.m2 / ((pixel.samples - 1) * (float)pixel.samples));
+  return error <= threshold * max(pixel.mean, 0.01f);
 }
 
 // Forward declaration
 ptr::light* add_light(ptr::scene* scene);
 
+// Cumulative sum of the weights
+static std::vector<float> make_cdf(const std::vector<float>& weights) {
+  auto cdf = std::vector<float>(weights.size());
+  auto sum = 0.0;
+  for (auto idx = 0; idx < weights.size(); idx++) {
+    sum += weights[idx];
+    cdf[idx] = (float)sum;
+  }
+  return cdf;
+}
+
+// Build an alias table for `size` weights with Vose's method. Entries are
+// split into the ones below and above the average weight, and each small
+// entry is filled up by a large one, which becomes its alias.
+static void make_alias_table(
+    const float* weights, int size, alias_entry* alias) {
+  auto sum = 0.0;
+  for (auto idx = 0; idx < size; idx++) sum += weights[idx];
+  if (sum <= 0) {
+    for (auto idx = 0; idx < size; idx++) alias[idx] = {1, idx};
+    return;
+  }
+
+  // scaled probabilities, with an average of one
+  auto scaled = std::vector<double>(size);
+  auto small  = std::vector<int>{};
+  auto large  = std::vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = weights[idx] * size / sum;
+    alias[idx]  = {1, idx};
+    (scaled[idx] < 1 ? small : large).push_back(idx);
+  }
+
+  // pair small and large entries
+  while (!small.empty() && !large.empty()) {
+    auto s = small.back(), l = large.back();
+    small.pop_back();
+    alias[s].prob  = (float)scaled[s];
+    alias[s].alias = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // leftovers are one up to rounding
+  for (auto idx : large) alias[idx].prob = 1;
+  for (auto idx : small) alias[idx].prob = 1;
+}
+
+// Build an alias table for the weights
+std::vector<alias_entry> make_alias_table(const std::vector<float>& weights) {
+  auto alias = std::vector<alias_entry>(weights.size());
+  make_alias_table(weights.data(), (int)weights.size(), alias.data());
+  return alias;
+}
+
+// Smallest cone containing two cones of directions. Cones of cosine -1
+// cover the whole sphere.
+static std::pair<vec3f, float> merge_cones(
+    const vec3f& axis_a, float cos_a, const vec3f& axis_b, float cos_b) {
+  auto theta_a = acos(clamp(cos_a, -1.0f, 1.0f));
+  auto theta_b = acos(clamp(cos_b, -1.0f, 1.0f));
+  auto theta_d = acos(clamp(dot(axis_a, axis_b), -1.0f, 1.0f));
+  if (min(theta_d + theta_b, pif) <= theta_a) return {axis_a, cos_a};
+  if (min(theta_d + theta_a, pif) <= theta_b) return {axis_b, cos_b};
+  auto theta_o = (theta_a + theta_d + theta_b) / 2;
+  if (theta_o >= pif) return {axis_a, -1};
+  auto rotation = cross(axis_a, axis_b);
+  if (length(rotation) < 1e-6f) return {axis_a, -1};
+  rotation   = normalize(rotation);
+  auto angle = theta_o - theta_a;
+  auto axis  = axis_a * cos(angle) + cross(rotation, axis_a) * sin(angle);
+  return {normalize(axis), cos(theta_o)};
+}
+
+// Build a light bvh node over lights [start, end), splitting at the median
+// centroid along the largest axis so that the tree stays balanced.
+static void build_light_node(light_tree* tree, int nodeid, int parent,
+    std::vector<int>& lights, int start, int end,
+    const std::vector<light_node>& bounds) {
+  // merge bounds
+  auto node = light_node{};
+  for (auto idx = start; idx < end; idx++) {
+    auto& light = bounds[lights[idx]];
+    node.bbox   = merge(node.bbox, light.bbox);
+    if (idx == start) {
+      node.axis      = light.axis;
+      node.cos_theta = light.cos_theta;
+    } else {
+      std::tie(node.axis, node.cos_theta) = merge_cones(
+          node.axis, node.cos_theta, light.axis, light.cos_theta);
+    }
+    node.power += light.power;
+  }
+  node.parent = parent;
+
+  // leaf
+  if (end - start == 1) {
+    node.start                  = lights[start];
+    tree->nodes[nodeid]         = node;
+    tree->leaves[lights[start]] = nodeid;
+    return;
+  }
+
+  // split at the median
+  auto cbbox = invalidb3f;
+  for (auto idx = start; idx < end; idx++)
+    cbbox = merge(cbbox, center(bounds[lights[idx]].bbox));
+  auto csize = size(cbbox);
+  auto axis  = (csize.x >= csize.y && csize.x >= csize.z) ? 0
+               : (csize.y >= csize.z)                     ? 1
+                                                          : 2;
+  auto mid   = (start + end) / 2;
+  std::nth_element(lights.data() + start, lights.data() + mid,
+      lights.data() + end, [axis, &bounds](int a, int b) {
+        return center(bounds[a].bbox)[axis] < center(bounds[b].bbox)[axis];
+      });
+
+  // children
+  node.internal       = true;
+  node.start          = (int)tree->nodes.size();
+  tree->nodes[nodeid] = node;
+  tree->nodes.resize(tree->nodes.size() + 2);
+  build_light_node(tree, node.start, nodeid, lights, start, mid, bounds);
+  build_light_node(tree, node.start + 1, nodeid, lights, mid, end, bounds);
+}
+
+// Build the light bvh over the mesh lights of the scene
+static void init_light_bvh(ptr::scene* scene) {
+  if (scene->light_bvh) delete scene->light_bvh;
+  auto tree        = scene->light_bvh = new light_tree{};
+  tree->leaves     = std::vector<int>(scene->lights.size(), -1);
+  auto bounds      = std::vector<light_node>(scene->lights.size());
+  auto mesh_lights = std::vector<int>{};
+  for (auto light_id = 0; light_id < scene->lights.size(); light_id++) {
+    auto light = scene->lights[light_id];
+    if (!light->object) {
+      tree->environments.push_back(light_id);
+      continue;
+    }
+
+    // bound positions and normals in world space, with power given by
+    // the emission at the center of each triangle times its area
+    auto  object = light->object;
+    auto  shape  = object->shape;
+    auto& lbound = bounds[light_id];
+    for (auto& t : shape->triangles) {
+      auto p0 = transform_point(object->frame, shape->positions[t.x]);
+      auto p1 = transform_point(object->frame, shape->positions[t.y]);
+      auto p2 = transform_point(object->frame, shape->positions[t.z]);
+      lbound.bbox = merge(merge(merge(lbound.bbox, p0), p1), p2);
+      auto normal = triangle_normal(p0, p1, p2);
+      auto element  = (int)(&t - shape->triangles.data());
+      auto emission = eval_emission(
+          object, element, {1 / 3.0f, 1 / 3.0f}, normal, normal);
+      lbound.power += max(emission) * triangle_area(p0, p1, p2);
+      if (&t == &shape->triangles.front()) {
+        lbound.axis = normal;
+      } else if (lbound.cos_theta > -1) {
+        std::tie(lbound.axis, lbound.cos_theta) = merge_cones(
+            lbound.axis, lbound.cos_theta, normal, 1);
+      }
+    }
+    mesh_lights.push_back(light_id);
+  }
+
+  if (mesh_lights.empty()) return;
+  tree->nodes.reserve(mesh_lights.size() * 2);
+  tree->nodes.emplace_back();
+  build_light_node(
+      tree, 0, -1, mesh_lights, 0, (int)mesh_lights.size(), bounds);
+}
+
 // Init trace lights
 void init_lights(ptr::scene* scene, const trace_params& params,
     progress_callback progress_cb) {
@@ -1477,21 +4809,25 @@ void init_lights(ptr::scene* scene, const trace_params& params,
 
   for (auto light : scene->lights) delete light;
   scene->lights.clear();
+  scene->light_ids.assign(scene->objects.size(), -1);
 
-  for (auto object : scene->objects) {
+  for (auto object_id = 0; object_id < scene->objects.size(); object_id++) {
+    auto object = scene->objects[object_id];
     if (object->material->emission == zero3f) continue;
     auto shape = object->shape;
     if (shape->triangles.empty()) continue;
     if (progress_cb) progress_cb("build light", progress.x++, ++progress.y);
+    scene->light_ids[object_id] = (int)scene->lights.size();
     auto light    = add_light(scene);
     light->object = object;
-    light->cdf    = std::vector<float>(shape->triangles.size());
-    for (auto idx = 0; idx < light->cdf.size(); idx++) {
-      auto& t         = shape->triangles[idx];
-      light->cdf[idx] = triangle_area(
+    auto weights  = std::vector<float>(shape->triangles.size());
+    for (auto idx = 0; idx < weights.size(); idx++) {
+      auto& t      = shape->triangles[idx];
+      weights[idx] = triangle_area(
           shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
-      if (idx) light->cdf[idx] += light->cdf[idx - 1];
     }
+    light->cdf   = make_cdf(weights);
+    light->alias = make_alias_table(weights);
   }
   for (auto environment : scene->environments) {
     if (environment->emission == zero3f) continue;
@@ -1501,17 +4837,30 @@ void init_lights(ptr::scene* scene, const trace_params& params,
     if (environment->emission_tex) {
       auto texture = environment->emission_tex;
       auto size    = texture_size(texture);
-      light->cdf   = std::vector<float>(size.x * size.y);
-      for (auto i = 0; i < light->cdf.size(); i++) {
-        auto ij       = vec2i{i % size.x, i / size.x};
-        auto th       = (ij.y + 0.5f) * pif / size.y;
-        auto value    = lookup_texture(texture, ij);
-        light->cdf[i] = max(value) * sin(th);
-        if (i) light->cdf[i] += light->cdf[i - 1];
+      auto weights = std::vector<float>(size.x);
+      auto rows    = std::vector<float>(size.y);
+      auto total   = 0.0;
+      light->alias = std::vector<alias_entry>(size.x * size.y);
+      for (auto j = 0; j < size.y; j++) {
+        auto sum = 0.0;
+        for (auto i = 0; i < size.x; i++) {
+          weights[i] = environment_weight(texture, {i, j});
+          sum += weights[i];
+        }
+        make_alias_table(weights.data(), size.x, &light->alias[j * size.x]);
+        rows[j] = (float)sum;
+        total += sum;
       }
+      light->marginal = make_alias_table(rows);
+      light->weight   = (float)total;
     }
   }
 
+  // build the light bvh
+  if (scene->light_bvh) delete scene->light_bvh;
+  scene->light_bvh = nullptr;
+  if (params.light_bvh) init_light_bvh(scene);
+
   // handle progress
   if (progress_cb) progress_cb("build light", progress.x++, progress.y);
 }
@@ -1720,55 +5069,28 @@ void init_state(ptr::state* state, const ptr::scene* scene,
   for (auto& pixel : state->pixels) {
     pixel.rng = make_rng(params.seed, rand1i(rng, 1 << 31) / 2 + 1);
   }
+  state->ncounters = max(params.bounces, 0);
+  state->counters  = std::make_unique<bounce_counter[]>(state->ncounters);
 }
 
-using std::atomic;
-using std::deque;
-using std::future;
-
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
-template <typename Func>
-inline void parallel_for(const vec2i& size, Func&& func) {
-  auto             futures  = std::vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, size]() {
-          while (true) {
-            auto j = next_idx.fetch_add(1);
-            if (j >= size.y) break;
-            for (auto i = 0; i < size.x; i++) func({i, j});
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
-}
-template <typename Func>
-inline void parallel_for(
-    const vec2i& size, std::atomic<bool>* stop, Func&& func) {
-  auto             futures  = std::vector<std::future<void>>{};
-  auto             nthreads = std::thread::hardware_concurrency();
-  std::atomic<int> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, size, stop]() {
-          while (true) {
-            if (stop && *stop) return;
-            auto j = next_idx.fetch_add(1);
-            if (j >= size.y) break;
-            for (auto i = 0; i < size.x; i++) func({i, j});
-          }
-        }));
+// Per-bounce counters of the wavefront shader
+std::vector<bounce_stats> get_bounce_stats(const ptr::state* state) {
+  auto stats = std::vector<bounce_stats>{};
+  for (auto bounce = 0; bounce < state->ncounters; bounce++) {
+    auto& counter = state->counters[bounce];
+    if (!counter.rays) break;
+    stats.push_back({counter.rays, counter.nanoseconds / 1e9});
   }
-  for (auto& f : futures) f.get();
+  return stats;
 }
 
 // Progressively compute an image by calling trace_samples multiple times.
 void trace_samples(ptr::state* state, const ptr::scene* scene,
     const ptr::camera* camera, const trace_params& params) {
-  if (params.noparallel) {
+  init_thread_pool(params);
+  if (params.shader == shader_type::wavefront) {
+    trace_tiles(state, scene, camera, params, 1);
+  } else if (params.noparallel) {
     for (auto j = 0; j < state->render.size().y; j++) {
       for (auto i = 0; i < state->render.size().x; i++) {
         state->render[{i, j}] = trace_sample(
@@ -1786,7 +5108,10 @@ void trace_samples(ptr::state* state, const ptr::scene* scene,
 void trace_samples(ptr::state* state, const ptr::scene* scene,
     const ptr::camera* camera, const trace_params& params,
     std::atomic<bool>* stop) {
-  if (params.noparallel) {
+  init_thread_pool(params);
+  if (params.shader == shader_type::wavefront) {
+    trace_tiles(state, scene, camera, params, 1, {}, stop);
+  } else if (params.noparallel) {
     for (auto j = 0; j < state->render.size().y; j++) {
       for (auto i = 0; i < state->render.size().x; i++) {
         if (stop && stop) return;
@@ -1802,6 +5127,94 @@ void trace_samples(ptr::state* state, const ptr::scene* scene,
   }
 }
 
+// Compute many samples per pixel at once, tile by tile.
+void trace_tiles(ptr::state* state, const ptr::scene* scene,
+    const ptr::camera* camera, const trace_params& params, int samples,
+    progress_callback progress_cb, std::atomic<bool>* stop) {
+  init_thread_pool(params);
+  auto size   = state->render.size();
+  auto tile   = max(params.tile_size, 1);
+  auto ntiles = vec2i{(size.x + tile - 1) / tile, (size.y + tile - 1) / tile};
+
+  // adaptive sampling splits samples in passes, otherwise a single one
+  auto adaptive = params.adaptive > 0;
+  auto batch    = adaptive ? max(params.batch, 1) : max(samples, 1);
+  auto npasses  = (samples + batch - 1) / batch;
+  auto tiles    = std::vector<int>(ntiles.x * ntiles.y);
+  for (auto tile_id = 0; tile_id < tiles.size(); tile_id++)
+    tiles[tile_id] = tile_id;
+
+  // handle progress
+  auto progress       = vec2i{0, (int)tiles.size() * npasses};
+  auto progress_mutex = std::mutex{};
+  if (progress_cb) progress_cb("render image", progress.x, progress.y);
+
+  // trace a pass of samples over a tile, one sample at a time over its
+  // pixels, and return whether the tile has pixels that are not converged
+  auto trace_tile = [&](int tile_id, int nsamples) {
+    if (stop && *stop) return false;
+    auto start = vec2i{tile_id % ntiles.x, tile_id / ntiles.x} * tile;
+    auto end   = min(start + tile, size);
+    for (auto sample = 0; sample < nsamples; sample++) {
+      if (stop && *stop) return false;
+      if (params.shader == shader_type::wavefront) {
+        trace_wavefront(state, scene, camera, start, end, params, adaptive);
+        continue;
+      }
+      for (auto j = start.y; j < end.y; j++) {
+        for (auto i = start.x; i < end.x; i++) {
+          if (adaptive && state->pixels[{i, j}].converged) continue;
+          state->render[{i, j}] = trace_sample(
+              state, scene, camera, {i, j}, params);
+        }
+      }
+    }
+    if (progress_cb) {
+      auto lock = std::lock_guard{progress_mutex};
+      progress_cb("render image", ++progress.x, progress.y);
+    }
+    if (!adaptive) return false;
+    auto active = false;
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        auto& pixel = state->pixels[{i, j}];
+        if (!pixel.converged)
+          pixel.converged = is_converged(pixel, params.adaptive);
+        if (!pixel.converged) active = true;
+      }
+    }
+    return active;
+  };
+
+  // dispatch again the tiles that are not converged
+  for (auto pass = 0; pass < npasses && !tiles.empty(); pass++) {
+    if (stop && *stop) return;
+    auto nsamples   = min(batch, samples - pass * batch);
+    auto active     = std::vector<char>(tiles.size(), 0);
+    auto trace_pass = [&](int idx) {
+      active[idx] = trace_tile(tiles[idx], nsamples);
+    };
+    if (params.noparallel) {
+      for (auto idx = 0; idx < tiles.size(); idx++) trace_pass(idx);
+    } else {
+      parallel_for((int)tiles.size(), trace_pass);
+    }
+    auto count = 0;
+    for (auto idx = 0; idx < tiles.size(); idx++) {
+      if (active[idx]) tiles[count++] = tiles[idx];
+    }
+    tiles.resize(count);
+    // skip the passes of converged tiles
+    auto done = (pass + 1) * ntiles.x * ntiles.y;
+    if (progress_cb && progress.x != done && !(stop && *stop)) {
+      progress.x = done;
+      progress_cb("render image", progress.x, progress.y);
+    }
+  }
+  if (progress_cb && progress.x != progress.y && !(stop && *stop))
+    progress_cb("render image", progress.y, progress.y);
+}
+
 }  // namespace yocto::pathtrace
 
 // -----------------------------------------------------------------------------
@@ -1817,6 +5230,7 @@ shape::~shape() {
 // cleanup
 scene::~scene() {
   if (bvh) delete bvh;
+  if (light_bvh) delete light_bvh;
   for (auto camera : cameras) delete camera;
   for (auto object : objects) delete object;
   for (auto shape : shapes) delete shape;
@@ -1939,7 +5353,8 @@ void set_subdiv_displacement(
 
 // Add object
 void set_frame(ptr::object* object, const frame3f& frame) {
-  object->frame = frame;
+  object->frame     = frame;
+  object->inv_frame = inverse(frame, !is_rigid(frame));
 }
 void set_shape(ptr::object* object, ptr::shape* shape) {
   object->shape = shape;
@@ -42,9 +42,11 @@
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 
+#include <array>
 #include <atomic>
 #include <future>
 #include <memory>
+#include <new>
 
 // -----------------------------------------------------------------------------
 // ALIASES
@@ -161,10 +163,28 @@ void set_emission(ptr::environment* environment, const vec3f& emission,
 
 // Type of tracing algorithm
 enum struct shader_type {
-  naive,     // naive path tracing
-  path,      // path tracing with mis
-  eyelight,  // eyelight rendering
-  normal,    // normal rendering
+  naive,      // naive path tracing
+  path,       // path tracing with mis
+  wavefront,  // path tracing with mis, traced in wavefronts
+  nee,        // path tracing with shadow rays to lights and two-sample mis
+  eyelight,   // eyelight rendering
+  normal,     // normal rendering
+};
+
+// Strategy used to build the bvh
+enum struct bvh_type {
+  middle,  // split at the middle of the largest axis
+  sah,     // binned surface area heuristic with adaptive leaf size
+  sbvh,    // surface area heuristic with spatial splits of shape primitives
+};
+
+// Layout of the bvh nodes used during traversal
+enum struct bvh_layout {
+  binary,     // binary tree testing one box per node
+  wide4,      // 4-wide tree testing four boxes at once with SIMD
+  wide8,      // 8-wide tree testing eight boxes at once with SIMD
+  compact,    // depth-first tree with 32-byte nodes
+  quantized,  // depth-first tree with 16-byte nodes and 8-bit bounds
 };
 
 // Default trace seed
@@ -178,12 +198,30 @@ struct trace_params {
   int         bounces    = 8;
   float       clamp      = 100;
   uint64_t    seed       = default_seed;
+  bvh_type    bvh        = bvh_type::middle;
+  bvh_layout  layout     = bvh_layout::binary;
+  bool        triangles  = true;  // precompute triangles and lines in leaves
+  std::string bvh_cache  = "";    // directory of cached shape bvhs
+  bool        reorder    = true;  // depth-first bvh node order
   bool        noparallel = false;
+  int         threads    = 0;      // worker threads, 0 for all cores
+  bool        affinity   = false;  // pin worker threads to cores
+  int         tile_size  = 32;     // tile size used by trace_tiles()
+  float       adaptive   = 0;      // error threshold, 0 to disable adaptive
+  int         batch      = 16;     // samples per adaptive pass
+  bool        light_bvh  = true;   // sample lights with the light bvh
+  bool        exact_pdf  = false;  // trace lights to evaluate light pdfs
+  bool        ray_sort   = false;  // sort wavefront rays before traversal
   int         pratio     = 8;
 };
 
 const auto shader_names = std::vector<std::string>{
-    "naive", "path", "eyelight", "normal"};
+    "naive", "path", "wavefront", "nee", "eyelight", "normal"};
+
+const auto bvh_names = std::vector<std::string>{"middle", "sah", "sbvh"};
+
+const auto bvh_layout_names = std::vector<std::string>{
+    "binary", "wide4", "wide8", "compact", "quantized"};
 
 // Progress report callback
 using progress_callback =
@@ -193,6 +231,37 @@ using progress_callback =
 void init_bvh(ptr::scene* scene, const trace_params& params,
     progress_callback progress_cb = {});
 
+// Update the bvh after moving objects or changing the vertices of shapes.
+// Updated shape bvhs are refit, keeping their topology, while the scene bvh
+// and the light bvh are rebuilt. Shapes must keep their primitives. Call
+// init_lights() instead after changing the vertices of emitters.
+void update_bvh(ptr::scene* scene,
+    const std::vector<ptr::shape*>& updated_shapes,
+    const trace_params&             params);
+
+// Bvh statistics used to compare build strategies. The SAH cost is the
+// expected cost of tracing a random ray, measured in primitive intersections,
+// for the scene bvh and summed over all the shape bvhs.
+struct bvh_stats {
+  int    nodes       = 0;
+  int    leaves      = 0;
+  int    primitives  = 0;
+  int    max_depth   = 0;
+  int    max_prims   = 0;
+  float  scene_cost  = 0;
+  float  shape_cost  = 0;
+  size_t memory      = 0;  // all bvh arrays, in bytes
+  size_t node_memory = 0;  // nodes used for traversal, in bytes
+};
+
+// Compute bvh statistics. Requires the bvh to be initialized.
+bvh_stats get_bvh_stats(const ptr::scene* scene);
+
+// Average number of cache misses per camera ray when traversing the binary
+// bvh nodes, simulated with a 32kb cache. Used to compare node orderings.
+float get_bvh_cache_misses(const ptr::scene* scene, const ptr::camera* camera,
+    const trace_params& params);
+
 // Initialize the rendering state
 struct state;
 void init_state(ptr::state* state, const ptr::scene* scene,
@@ -215,6 +284,36 @@ void trace_samples(ptr::state* state, const ptr::scene* scene,
     const ptr::camera* camera, const trace_params& params,
     std::atomic<bool>* stop);
 
+// Computes `samples` samples per pixel at once. The image is split in square
+// tiles of `params.tile_size` pixels, rendered in parallel, and each tile
+// traces all its samples while its pixels stay in cache. Since pixels keep
+// their own random number generators, the image is the same as the one of
+// `samples` calls to trace_samples(). Stop if requested.
+// If `params.adaptive` is positive, tiles are traced in passes of
+// `params.batch` samples and pixels whose relative standard error falls
+// below `params.adaptive` stop sampling. Tiles with unconverged pixels are
+// dispatched again until all pixels converge or reach `samples` samples.
+void trace_tiles(ptr::state* state, const ptr::scene* scene,
+    const ptr::camera* camera, const trace_params& params, int samples,
+    progress_callback progress_cb = {}, std::atomic<bool>* stop = nullptr);
+
+// Rays traced at one bounce by the wavefront shader, and the time spent
+// sorting and intersecting them.
+struct bounce_stats {
+  int64_t rays    = 0;
+  double  seconds = 0;
+};
+
+// Per-bounce counters of the wavefront shader since init_state(). Bounces
+// are counted as intersection rounds, so rays passing through cutouts are
+// counted at the next bounce.
+std::vector<bounce_stats> get_bounce_stats(const ptr::state* state);
+
+// Number of rays traced to evaluate light pdfs since the program started.
+// Light pdfs trace rays only if `exact_pdf` is set, since otherwise
+// they reuse the intersection of the next path ray.
+int64_t get_light_pdf_rays();
+
 }  // namespace yocto::pathtrace
 
 // -----------------------------------------------------------------------------
@@ -222,6 +321,31 @@ void trace_samples(ptr::state* state, const ptr::scene* scene,
 // -----------------------------------------------------------------------------
 namespace yocto::pathtrace {
 
+// Allocator used to align bvh node arrays to cache lines.
+template <typename T>
+struct bvh_allocator {
+  using value_type = T;
+  bvh_allocator()  = default;
+  template <typename U>
+  bvh_allocator(const bvh_allocator<U>&) {}
+  T* allocate(size_t n) {
+    return (T*)::operator new(n * sizeof(T), std::align_val_t{64});
+  }
+  void deallocate(T* ptr, size_t n) {
+    ::operator delete(ptr, n * sizeof(T), std::align_val_t{64});
+  }
+  template <typename U>
+  bool operator==(const bvh_allocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const bvh_allocator<U>&) const {
+    return false;
+  }
+};
+template <typename T>
+using bvh_vector = std::vector<T, bvh_allocator<T>>;
+
 // BVH tree node containing its bounds, indices to the BVH arrays of either
 // primitives or internal nodes, the node element type,
 // and the split axis. Leaf and internal nodes are identical, except that
@@ -234,13 +358,85 @@ struct bvh_node {
   byte   axis;
 };
 
+// Wide BVH node with N children, obtained by collapsing the binary tree.
+// Children bounds are stored in SoA form, as min x, y, z and max x, y, z,
+// so that all children are tested at once with SIMD instructions. Internal
+// children have `num` set to zero and `start` referring to the wide node
+// array, while leaves refer to the primitive array. Unused children have
+// empty bounds.
+template <int N>
+struct alignas(32) bvh_wide_node {
+  float bbox[6][N] = {};
+  int   start[N]   = {};
+  short num[N]     = {};
+};
+using bvh_node4 = bvh_wide_node<4>;
+using bvh_node8 = bvh_wide_node<8>;
+
+// Compact BVH node stored in depth-first order, so that the left child of an
+// internal node immediately follows it and only the right child is stored.
+// For leaves, `start` refers to the primitive array.
+struct bvh_compact_node {
+  bbox3f         bbox     = {};
+  int            start    = 0;
+  unsigned short num      = 0;
+  bool           internal = false;
+  byte           axis     = 0;
+};
+static_assert(sizeof(bvh_compact_node) == 32, "bad node size");
+
+// Quantized BVH node stored in depth-first order like compact nodes. Bounds
+// are stored as 8-bit offsets in the bounds of the parent node, rounded
+// outward, and are decoded during traversal.
+struct bvh_quantized_node {
+  byte qmin[3]  = {0, 0, 0};
+  byte qmax[3]  = {0, 0, 0};
+  bool internal = false;
+  byte axis     = 0;
+  int  start    = 0;
+  int  num      = 0;
+};
+static_assert(sizeof(bvh_quantized_node) == 16, "bad node size");
+
+// Triangles precomputed in the order of the bvh primitives, as the first
+// vertex and two edges, in SoA packets of four for SIMD intersection.
+// The triangle of primitive i is stored in packet i / 4 at lane i % 4.
+struct alignas(16) bvh_triangle4 {
+  float p0[3][4] = {};
+  float e1[3][4] = {};
+  float e2[3][4] = {};
+};
+
+// Lines precomputed in the order of the bvh primitives, as the first vertex,
+// the segment direction and the two radii, in SoA packets of four as above.
+struct alignas(16) bvh_line4 {
+  float p0[3][4] = {};
+  float v[3][4]  = {};
+  float r0[4]    = {};
+  float r1[4]    = {};
+};
+
+// Primitive type of the leaves of a shape bvh, selecting the traversal
+// kernels. Packed types use precomputed triangles or lines.
+enum struct bvh_leaf { none, points, lines, lines4, triangles, triangles4 };
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Application data is not stored explicitly. Wide, compact and quantized
+// nodes are only present if the corresponding layout is used for traversal.
+// Triangles and lines are present only if precomputed. Arrays are aligned to
+// cache lines.
 struct bvh_tree {
-  std::vector<bvh_node> nodes      = {};
-  std::vector<int>      primitives = {};
+  bvh_vector<bvh_node>           nodes      = {};
+  std::vector<int>               primitives = {};
+  bvh_vector<bvh_node4>          nodes4     = {};
+  bvh_vector<bvh_node8>          nodes8     = {};
+  bvh_vector<bvh_compact_node>   cnodes     = {};
+  bvh_vector<bvh_quantized_node> qnodes     = {};
+  bvh_vector<bvh_triangle4>      triangles  = {};
+  bvh_vector<bvh_line4>          lines      = {};
+  bvh_leaf                       leaf       = bvh_leaf::none;
 };
 
 // Camera based on a simple lens model. The camera is placed using a frame.
@@ -343,6 +539,9 @@ struct object {
   frame3f        frame    = identity3x4f;
   ptr::shape*    shape    = nullptr;
   ptr::material* material = nullptr;
+
+  // computed properties
+  frame3f inv_frame = identity3x4f;  // inverse frame used for ray traversal
 };
 
 // Environment map.
@@ -352,11 +551,57 @@ struct environment {
   ptr::texture* emission_tex = nullptr;
 };
 
+// Entry of an alias table, used to sample a discrete distribution in
+// constant time. An entry picked uniformly is kept with probability `prob`,
+// or replaced by `alias` otherwise.
+struct alias_entry {
+  float prob  = 1;
+  int   alias = 0;
+};
+
+// Build an alias table for the weights with Vose's method.
+std::vector<alias_entry> make_alias_table(const std::vector<float>& weights);
+
+// Sample an alias table, picking the entry with `r` and keeping it or taking
+// its alias with the independent random number `ra`.
+int sample_alias(const std::vector<alias_entry>& alias, float r, float ra);
+
 // Trace lights used during rendering. These are created automatically.
+// Triangles of mesh lights are sampled with the alias table, while the cdf
+// gives their total area. Environment texels are sampled with a 2D
+// distribution: the marginal alias table picks a row, and the alias table
+// of that row, stored contiguously in `alias`, picks the texel. Their pdf
+// is the texel weight over the total `weight`.
 struct light {
-  ptr::object*       object      = nullptr;
-  ptr::environment*  environment = nullptr;
-  std::vector<float> cdf         = {};
+  ptr::object*             object      = nullptr;
+  ptr::environment*        environment = nullptr;
+  std::vector<float>       cdf         = {};
+  std::vector<alias_entry> alias       = {};
+  std::vector<alias_entry> marginal    = {};
+  float                    weight      = 0;
+};
+
+// Node of the light bvh. Nodes bound the positions, power and normals of
+// their mesh lights, with normals bounded by a cone of cosine `cos_theta`
+// around `axis`. Children of internal nodes are stored at `start` and
+// `start + 1`, while leaves hold the single light `start`.
+struct light_node {
+  bbox3f bbox      = {};
+  float  power     = 0;
+  vec3f  axis      = {0, 0, 1};
+  float  cos_theta = 1;
+  int    start     = 0;
+  int    parent    = -1;
+  bool   internal  = false;
+};
+
+// Light bvh used to sample mesh lights by their contribution to the shading
+// point. Environments are sampled uniformly, with the tree counting as one
+// more light.
+struct light_tree {
+  std::vector<light_node> nodes        = {};
+  std::vector<int>        leaves       = {};  // leaf of each light, or -1
+  std::vector<int>        environments = {};  // environment lights
 };
 
 // Scene comprised an array of objects whose memory is owened by the scene.
@@ -375,7 +620,9 @@ struct scene {
   std::vector<ptr::environment*> environments = {};
 
   // computed elements
-  std::vector<ptr::light*> lights = {};
+  std::vector<ptr::light*> lights    = {};
+  std::vector<int>         light_ids = {};  // light of each object, or -1
+  light_tree*              light_bvh = nullptr;
 
   // computed properties
   bvh_tree* bvh = nullptr;
@@ -388,13 +635,24 @@ struct scene {
 struct pixel {
   vec4f     accumulated = {0, 0, 0, 0};
   int       samples     = 0;
+  float     mean        = 0;      // running mean of the sample luminance
+  float     m2          = 0;      // sum of squared deviations from the mean
+  bool      converged   = false;  // stopped by adaptive sampling
   rng_state rng         = {};
 };
 
+// Counters of the rays traced at one bounce by the wavefront shader
+struct bounce_counter {
+  std::atomic<int64_t> rays        = {0};
+  std::atomic<int64_t> nanoseconds = {0};
+};
+
 // Rendering state
 struct state {
-  img::image<vec4f> render = {};
-  img::image<pixel> pixels = {};
+  img::image<vec4f>                 render    = {};
+  img::image<pixel>                 pixels    = {};
+  std::unique_ptr<bounce_counter[]> counters  = {};  // one per bounce
+  int                               ncounters = 0;
 };
 
 }  // namespace yocto::pathtrace
@@ -418,11 +676,45 @@ struct intersection3f {
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
+// Instances are traversed with the inverse frames computed by init_bvh(),
+// where rigid frames are detected and inverted by transposition, so
+// `non_rigid_frames` is ignored.
 intersection3f intersect_scene_bvh(const ptr::scene* scene, const ray3f& ray,
     bool find_any = false, bool non_rigid_frames = true);
 intersection3f intersect_instance_bvh(const ptr::object* object,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Check whether a ray is occluded before the distance `tmax`. This is faster
+// than intersect_scene_bvh() with `find_any`, since it only reports whether
+// any occluder is found, and is meant for shadow rays.
+bool occluded(const ptr::scene* scene, const ray3f& ray, float tmax);
+
+// Packet of N coherent rays with the mask of its active lanes. Only active
+// rays are traced, while inactive lanes are returned as misses.
+template <int N>
+struct ray_packet {
+  ray3f    rays[N] = {};
+  uint32_t active  = (uint32_t)((1ull << N) - 1);
+};
+using ray_packet4  = ray_packet<4>;
+using ray_packet8  = ray_packet<8>;
+using ray_packet16 = ray_packet<16>;
+
+// Intersect a packet of 4, 8 or 16 rays with a bvh, traversing it once for
+// all active rays. Returns the intersection of each lane.
+template <int N>
+std::array<intersection3f, N> intersect_scene_bvh(const ptr::scene* scene,
+    const ray_packet<N>& packet, bool find_any = false);
+template <int N>
+std::array<intersection3f, N> intersect_instance_bvh(const ptr::object* object,
+    const ray_packet<N>& packet, bool find_any = false);
+
+// Intersect a stream of rays with the scene bvh, returning one intersection
+// per ray. Rays are traced in packets in the given order, so coherent rays
+// should be adjacent.
+std::vector<intersection3f> intersect_scene_bvh(const ptr::scene* scene,
+    const std::vector<ray3f>& rays, bool find_any = false);
+
 }  // namespace yocto::pathtrace
 
 #endif